@@ -16,8 +16,16 @@ set -e
 #
 VSN=f904d1b
 
+# Local changes to libutp live in libutp-patches and are applied in order
+# after the tarball is extracted. The checksum of the patch set is recorded
+# in the extracted tree so that adding or changing a patch forces a fresh
+# extraction and rebuild.
+#
 [ `basename $PWD` = c_src ] || cd c_src
 
+PATCHES=`ls libutp-patches/*.patch 2>/dev/null || true`
+PATCHSUM=`cat $PATCHES /dev/null | cksum`
+
 case "$1" in
     clean)
         make clean
@@ -25,8 +33,18 @@ case "$1" in
         ;;
 
     *)
+        if [ -d libutp ] && \
+               [ "`cat libutp/.patchsum 2>/dev/null`" != "$PATCHSUM" ]; then
+            rm -rf libutp
+        fi
         if [ ! -f libutp/libutp.a ]; then
-            [ -d libutp ] || tar -xzf libutp-${VSN}.tar.gz
+            if [ ! -d libutp ]; then
+                tar -xzf libutp-${VSN}.tar.gz
+                for p in $PATCHES; do
+                    ( cd libutp && patch -s -p1 < ../$p )
+                done
+                echo "$PATCHSUM" > libutp/.patchsum
+            fi
             ( cd libutp && make CXXFLAGS+="$DRV_CFLAGS" )
         fi
         make all
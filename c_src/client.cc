@@ -21,15 +21,19 @@
 // -------------------------------------------------------------------
 
 #include "client.h"
+#include "shared_socket.h"
 #include "globals.h"
 #include "locker.h"
 #include "drv_types.h"
+#include "engine.h"
 
 
 using namespace UtpDrv;
 
-UtpDrv::Client::Client(int sock, const SockOpts& so, const Binary& ref) :
-    UtpHandler(sock, so)
+UtpDrv::Client::Client(int sock, const SockOpts& so, const Binary& ref,
+                       SharedSocket* ss) :
+    UtpHandler(sock, so, ss != 0 ? ss->utp_engine() : Engine::next()),
+    shared(ss)
 {
     UTPDRV_TRACER << "Client::Client " << this
                   << ", socket " << sock << UTPDRV_TRACE_ENDL;
@@ -39,6 +43,21 @@ UtpDrv::Client::Client(int sock, const SockOpts& so, const Binary& ref) :
 UtpDrv::Client::~Client()
 {
     UTPDRV_TRACER << "Client::~Client " << this << UTPDRV_TRACE_ENDL;
+    if (shared != 0) {
+        shared->release();
+    }
+}
+
+void
+UtpDrv::Client::set_port(ErlDrvPort p)
+{
+    UTPDRV_TRACER << "Client::set_port " << this << UTPDRV_TRACE_ENDL;
+    if (shared != 0) {
+        // the SharedSocket reads the socket for us
+        Handler::set_port(p);
+    } else {
+        UtpHandler::set_port(p);
+    }
 }
 
 ErlDrvSSizeT
@@ -58,8 +77,8 @@ UtpDrv::Client::connect_to(const SockAddr& addr)
 {
     UTPDRV_TRACER << "Client::connect_to " << this << UTPDRV_TRACE_ENDL;
     status = connect_pending;
-    MutexLocker lock(utp_mutex);
-    utp = UTP_Create(&Client::send_to, this, addr, addr.slen);
+    Engine::Lock lock(engine);
+    utp = UTP_Create(engine->ctx, &Client::send_to, this, addr, addr.slen);
     set_utp_callbacks();
     UTP_Connect(utp);
 }
@@ -29,19 +29,39 @@
 
 namespace UtpDrv {
 
+class SharedSocket;
+
 class Client : public UtpHandler
 {
 public:
-    Client(int sock, const SockOpts& so, const Binary& ref);
+    // If shared is set, sock belongs to that SharedSocket, which reads it
+    // on our behalf
+    Client(int sock, const SockOpts& so, const Binary& ref,
+           SharedSocket* shared = 0);
     ~Client();
 
+    void set_port(ErlDrvPort p);
+
     ErlDrvSSizeT
     control(unsigned command, const char* buf, ErlDrvSizeT len,
             char** rbuf, ErlDrvSizeT rlen);
 
     void connect_to(const SockAddr& addr);
 
+    // A connection on a shared socket never reads the socket itself, so
+    // it cannot use the options that act on received datagrams or on the
+    // socket's error queue
+    static bool shared_opts_supported(const SockOpts& so) {
+        return !so.gro && !so.zerocopy;
+    }
+
 private:
+    SharedSocket* shared;
+
+    bool opts_supported(const SockOpts& so) const {
+        return shared == 0 || shared_opts_supported(so);
+    }
+
     ErlDrvSSizeT
     connect_validate(const char* buf, ErlDrvSizeT len,
                      char** rbuf, ErlDrvSizeT rlen);
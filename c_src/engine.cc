@@ -0,0 +1,141 @@
+// -------------------------------------------------------------------
+//
+// engine.cc: independent libutp contexts
+//
+// Copyright (c) 2012-2013 Basho Technologies, Inc. All Rights Reserved.
+//
+// This file is provided to you under the Apache License,
+// Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License.  You may obtain
+// a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+//
+// -------------------------------------------------------------------
+
+#include "engine.h"
+#include "globals.h"
+#include "locker.h"
+#include "main_handler.h"
+#include "libutp/utp_utils.h"
+
+
+using namespace UtpDrv;
+
+UtpDrv::Engine::Pool UtpDrv::Engine::pool;
+ErlDrvMutex* UtpDrv::Engine::pool_mutex = 0;
+UtpDrv::Engine::Pool::size_type UtpDrv::Engine::next_engine = 0;
+int UtpDrv::Engine::timer_min_delay = UTP_TIMER_MIN_DELAY;
+
+UtpDrv::Engine::Engine() :
+    ctx(UTP_CreateContext()),
+    mutex(erl_drv_mutex_create(const_cast<char*>("utp"))),
+    timer_due(0), timer_armed(false)
+{
+}
+
+UtpDrv::Engine::~Engine()
+{
+    UTP_DestroyContext(ctx);
+    erl_drv_mutex_destroy(mutex);
+}
+
+void
+UtpDrv::Engine::driver_init()
+{
+    ErlDrvSysInfo info;
+    driver_system_info(&info, sizeof info);
+    int count = info.scheduler_threads > 0 ? info.scheduler_threads : 1;
+    UTPDRV_TRACER << "Engine::driver_init " << count
+                  << " engines" << UTPDRV_TRACE_ENDL;
+    pool_mutex = erl_drv_mutex_create(const_cast<char*>("utpengines"));
+    for (int i = 0; i < count; ++i) {
+        pool.push_back(new Engine);
+    }
+    next_engine = 0;
+}
+
+void
+UtpDrv::Engine::driver_finish()
+{
+    UTPDRV_TRACER << "Engine::driver_finish" << UTPDRV_TRACE_ENDL;
+    for (Pool::iterator it = pool.begin(); it != pool.end(); ++it) {
+        delete *it;
+    }
+    pool.clear();
+    erl_drv_mutex_destroy(pool_mutex);
+    pool_mutex = 0;
+}
+
+UtpDrv::Engine*
+UtpDrv::Engine::next()
+{
+    MutexLocker lock(pool_mutex);
+    Engine* engine = pool[next_engine];
+    next_engine = (next_engine + 1) % pool.size();
+    return engine;
+}
+
+void
+UtpDrv::Engine::check_timeouts()
+{
+    for (Pool::iterator it = pool.begin(); it != pool.end(); ++it) {
+        Engine* engine = *it;
+        Engine::Lock lock(engine);
+        SendBatch::Scope batch(engine->send_batch);
+        UTP_CheckTimeouts(engine->ctx);
+    }
+}
+
+long
+UtpDrv::Engine::next_timeout()
+{
+    long delay = -1;
+    for (Pool::iterator it = pool.begin(); it != pool.end(); ++it) {
+        Engine* engine = *it;
+        Engine::Lock lock(engine);
+        long due = UTP_NextTimeout(engine->ctx);
+        engine->timer_armed = due >= 0;
+        if (due >= 0) {
+            if (due < timer_min_delay) {
+                due = timer_min_delay;
+            }
+            engine->timer_due = UTP_GetMilliseconds() + due;
+            if (delay < 0 || due < delay) {
+                delay = due;
+            }
+        }
+    }
+    return delay;
+}
+
+void
+UtpDrv::Engine::set_timer_min_delay(int ms)
+{
+    timer_min_delay = ms;
+}
+
+void
+UtpDrv::Engine::check_deadline()
+{
+    int delay = UTP_NextTimeout(ctx);
+    if (delay < 0) {
+        return;
+    }
+    if (delay < timer_min_delay) {
+        delay = timer_min_delay;
+    }
+    uint32 due = UTP_GetMilliseconds() + delay;
+    if (!timer_armed || static_cast<int32>(due - timer_due) < 0) {
+        timer_armed = true;
+        timer_due = due;
+        MainHandler::wake_timer();
+    }
+}
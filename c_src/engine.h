@@ -0,0 +1,138 @@
+#ifndef UTPDRV_ENGINE_H
+#define UTPDRV_ENGINE_H
+
+// -------------------------------------------------------------------
+//
+// engine.h: independent libutp contexts
+//
+// Copyright (c) 2012-2013 Basho Technologies, Inc. All Rights Reserved.
+//
+// This file is provided to you under the Apache License,
+// Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License.  You may obtain
+// a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+//
+// -------------------------------------------------------------------
+
+#include <vector>
+#include "erl_driver.h"
+#include "libutp/utp.h"
+#include "udp_batch.h"
+
+
+namespace UtpDrv {
+
+// Shortest delay, in milliseconds, the driver timer is armed for; libutp
+// deadlines due sooner than this wait for it. The high resolution timer
+// can go down to the millisecond granularity of libutp's own clock.
+const int UTP_TIMER_MIN_DELAY = 10;
+const int UTP_HIRES_TIMER_MIN_DELAY = 1;
+
+// An Engine is one libutp context, the mutex serializing every call into
+// it, and the SendBatch collecting the datagrams it emits while that mutex
+// is held. The driver creates one Engine per scheduler thread and assigns
+// each listener and connection to one of them, round robin, for its whole
+// life. A Server lives in its Listener's engine and a Client using a
+// shared socket lives in that socket's engine, since libutp can only route
+// datagrams among sockets of the same context. Handlers in different
+// engines never contend for a lock.
+//
+// Engines only let port commands run in parallel: sends, setopts, recv
+// and close on sockets of different engines no longer wait for each
+// other, nor for the main port unless it is working in their engine.
+// libutp's own processing is still effectively single threaded. Every
+// UDP socket is selected on the main port, whose ready_input is
+// serialized by the port lock, so incoming datagrams of all engines are
+// read one batch at a time into the shared recv_batch, and the main
+// port's timer runs UTP_CheckTimeouts for one engine after another.
+//
+// The driver timer only runs while some engine has a pending libutp
+// deadline, and is armed for the earliest of them. Each engine remembers
+// the deadline the timer was last armed for on its behalf; a Lock that
+// leaves the engine with an earlier one wakes the main port to rearm it.
+class Engine
+{
+public:
+    static void driver_init();
+    static void driver_finish();
+
+    // Return the engine a new Listener, SharedSocket or Client should use
+    static Engine* next();
+
+    // Let libutp process timeouts in every engine
+    static void check_timeouts();
+
+    // Return the delay in milliseconds the driver timer should be armed
+    // for, or -1 if no engine has a pending deadline
+    static long next_timeout();
+
+    // Set the shortest delay next_timeout returns
+    static void set_timer_min_delay(int ms);
+
+    class Lock
+    {
+    public:
+        explicit Lock(Engine* eng) : engine(eng) {
+            erl_drv_mutex_lock(engine->mutex);
+        }
+        ~Lock() {
+            engine->check_deadline();
+            erl_drv_mutex_unlock(engine->mutex);
+        }
+
+    private:
+        Engine* engine;
+
+        // prevent copies
+        Lock(const Lock&);
+        void operator=(const Lock&);
+    };
+
+    // Wake the main port if libutp has a deadline earlier than the one the
+    // timer is armed for. Must be called with mutex held; a Lock calls it
+    // on release.
+    void check_deadline();
+
+    UTPContext* ctx;
+    ErlDrvMutex* mutex;
+    SendBatch send_batch;
+
+private:
+    Engine();
+    ~Engine();
+
+    // guarded by mutex
+    uint32 timer_due;
+    bool timer_armed;
+
+    typedef std::vector<Engine*> Pool;
+    static Pool pool;
+    static ErlDrvMutex* pool_mutex;
+    static int timer_min_delay;
+    static Pool::size_type next_engine;
+
+    // prevent copies
+    Engine(const Engine&);
+    void operator=(const Engine&);
+};
+
+}
+
+
+// this block comment is for emacs, do not delete
+// Local Variables:
+// mode: c++
+// c-file-style: "stroustrup"
+// c-file-offsets: ((innamespace . 0))
+// End:
+
+#endif
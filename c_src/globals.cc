@@ -27,5 +27,3 @@ using namespace UtpDrv;
 
 // non-const due to Erlang driver function requirements
 char* UtpDrv::drv_name = const_cast<char*>("utpdrv");
-
-ErlDrvMutex* UtpDrv::utp_mutex = 0;
@@ -41,8 +41,6 @@ const int INVALID_SOCKET = -1;
 
 extern char* drv_name;
 
-extern ErlDrvMutex* utp_mutex;
-
 }
 
 
@@ -48,6 +48,11 @@ UtpDrv::Handler::set_port(ErlDrvPort p)
     set_port_control_flags(port, PORT_CONTROL_FLAG_BINARY);
 }
 
+void
+UtpDrv::Handler::timeout()
+{
+}
+
 void
 UtpDrv::Handler::process_exited(const ErlDrvMonitor*, ErlDrvTermData proc)
 {
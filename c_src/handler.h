@@ -42,9 +42,18 @@ enum Commands {
     UTP_PEERNAME,
     UTP_SETOPTS,
     UTP_GETOPTS,
-    UTP_CANCEL_SEND,
     UTP_RECV,
-    UTP_CANCEL_RECV
+    UTP_CANCEL_RECV,
+    UTP_SHARDS,
+    UTP_RECV_ACK
+};
+
+// The data of every send starts with one of these bytes, telling the
+// driver whether the sender waits for a reply. Values must match those
+// defined in gen_utp.erl.
+enum SendModes {
+    UTP_SEND_SYNC = 0,
+    UTP_SEND_ASYNC
 };
 
 // Type for delivery of data from a port back to Erlang: binary or list
@@ -67,6 +76,8 @@ public:
 
     virtual void stop() = 0;
 
+    virtual void timeout();
+
     virtual void set_port(ErlDrvPort p);
 
     virtual void
@@ -21,6 +21,7 @@
 // -------------------------------------------------------------------
 
 #include <unistd.h>
+#include <algorithm>
 #include "libutp/utp.h"
 #include "listener.h"
 #include "globals.h"
@@ -28,12 +29,54 @@
 #include "utils.h"
 #include "locker.h"
 #include "server.h"
+#include "udp_batch.h"
+#include "engine.h"
 
 
 using namespace UtpDrv;
 
-UtpDrv::Listener::Listener(int sock, const SockOpts& so) :
-    SocketHandler(sock, so)
+// First byte of a version 1 uTP SYN packet: type ST_SYN (4) in the high
+// nibble, version in the low nibble
+const byte UTP_SYN_V1 = 0x41;
+const size_t UTP_HEADER_V1_SIZE = 20;
+
+static bool
+is_syn(const byte* p, size_t len)
+{
+    return len >= UTP_HEADER_V1_SIZE && p[0] == UTP_SYN_V1;
+}
+
+UtpDrv::ShardGroup::ShardGroup()
+{
+    mutex = erl_drv_mutex_create(const_cast<char*>("shard_group"));
+}
+
+UtpDrv::ShardGroup::~ShardGroup()
+{
+    erl_drv_mutex_destroy(mutex);
+}
+
+void
+UtpDrv::ShardGroup::join(Listener* lsnr)
+{
+    MutexLocker lock(mutex);
+    members.push_back(lsnr);
+}
+
+bool
+UtpDrv::ShardGroup::leave(Listener* lsnr)
+{
+    MutexLocker lock(mutex);
+    Members::iterator it = std::find(members.begin(), members.end(), lsnr);
+    if (it != members.end()) {
+        members.erase(it);
+    }
+    return members.empty();
+}
+
+UtpDrv::Listener::Listener(int sock, const SockOpts& so, ShardGroup* grp) :
+    SocketHandler(sock, so, Engine::next()), group(grp), users(0),
+    closed(false)
 {
     UTPDRV_TRACER << "Listener::Listener " << this
                   << ", socket " << sock << UTPDRV_TRACE_ENDL;
@@ -41,11 +84,16 @@ UtpDrv::Listener::Listener(int sock, const SockOpts& so) :
         throw SocketFailure(errno);
     }
     queue_mutex = erl_drv_mutex_create(const_cast<char*>("queue_mutex"));
+    ref_mutex = erl_drv_mutex_create(const_cast<char*>("listener_refs"));
+    if (group != 0) {
+        group->join(this);
+    }
 }
 
 UtpDrv::Listener::~Listener()
 {
     UTPDRV_TRACER << "Listener::~Listener " << this << UTPDRV_TRACE_ENDL;
+    erl_drv_mutex_destroy(ref_mutex);
     erl_drv_mutex_destroy(queue_mutex);
 }
 
@@ -59,21 +107,65 @@ UtpDrv::Listener::control(unsigned command, const char* buf, ErlDrvSizeT len,
         return accept(buf, len, rbuf, rlen);
     case UTP_CANCEL_ACCEPT:
         return cancel_accept(buf, len, rbuf, rlen);
+    case UTP_SHARDS:
+        return shards(buf, len, rbuf, rlen);
     }
     return SocketHandler::control(command, buf, len, rbuf, rlen);
 }
 
 void
-UtpDrv::Listener::outputv(ErlIOVec&)
+UtpDrv::Listener::outputv(ErlIOVec& ev)
 {
     UTPDRV_TRACER << "Listener::outputv " << this << UTPDRV_TRACE_ENDL;
-    send_not_connected(port);
+    send_result(port, driver_caller(port), ENOTCONN, take_send_mode(ev));
 }
 
 void
 UtpDrv::Listener::stop()
 {
     UTPDRV_TRACER << "Listener::stop " << this << UTPDRV_TRACE_ENDL;
+    {
+        MutexLocker qlock(queue_mutex);
+        leave_group();
+        acceptor_queue.clear();
+        {
+            // nobody will accept what is left in the backlog now
+            Engine::Lock lock(engine);
+            Backlog::iterator it = backlog.begin();
+            while (it != backlog.end()) {
+                (*it++)->abandon();
+            }
+            backlog.clear();
+            backlog_depth = 0;
+        }
+        MutexLocker rlock(ref_mutex);
+        closed = true;
+        if (users != 0) {
+            // Servers still share our socket, so keep reading it for them
+            // but stop accepting; the last one to go deletes us.
+            UTPDRV_TRACER << "Listener::stop: deferring for " << users
+                          << " shared connections" << UTPDRV_TRACE_ENDL;
+            MainHandler::del_monitors(this);
+            return;
+        }
+    }
+    if (selected) {
+        MainHandler::stop_input(udp_sock);
+        selected = false;
+    }
+    delete this;
+}
+
+void
+UtpDrv::Listener::release()
+{
+    UTPDRV_TRACER << "Listener::release " << this << UTPDRV_TRACE_ENDL;
+    {
+        MutexLocker rlock(ref_mutex);
+        if (--users != 0 || !closed) {
+            return;
+        }
+    }
     if (selected) {
         MainHandler::stop_input(udp_sock);
         selected = false;
@@ -85,17 +177,42 @@ void
 UtpDrv::Listener::input_ready()
 {
     UTPDRV_TRACER << "Listener::input_ready " << this << UTPDRV_TRACE_ENDL;
+    if (sockopts.shared_socket) {
+        input_ready_shared();
+    } else {
+        input_ready_per_connection();
+    }
+}
+
+void
+UtpDrv::Listener::backlog_drop(Server* server)
+{
+    UTPDRV_TRACER << "Listener::backlog_drop " << this << UTPDRV_TRACE_ENDL;
+    // called with engine->mutex held
+    backlog.remove(server);
+    backlog_depth = backlog.size();
+}
+
+void
+UtpDrv::Listener::input_ready_per_connection()
+{
     unsigned char buf[512];
     SockAddr from;
     int len = recvfrom(udp_sock, buf, sizeof buf, 0, from, &from.slen);
     if (len <= 0) {
         return;
     }
-    // if we have nobody accepting connections, just drop the message
+    // if we have nobody accepting connections and no room left in the
+    // backlog, just drop the message
     MutexLocker qlock(queue_mutex);
-    size_t qsize = acceptor_queue.size();
-    if (qsize == 0) {
-        return;
+    {
+        Engine::Lock lock(engine);
+        if (!can_accept()) {
+            if (is_syn(buf, len)) {
+                ++backlog_drops;
+            }
+            return;
+        }
     }
     int sock;
     if (open_udp_socket(sock, my_addr, true) < 0) {
@@ -108,52 +225,307 @@ UtpDrv::Listener::input_ready()
         } else if (res < 0 && errno != EINTR) {
             int err = errno;
             ::close(sock);
-            Acceptor& acc = acceptor_queue.front();
-            MainHandler::del_monitor(acc.caller);
-            ErlDrvTermData term[] = {
-                ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("utp_async")),
-                ERL_DRV_PORT, driver_mk_port(port),
-                ERL_DRV_EXT2TERM, acc.ref, acc.ref.size(),
-                ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("error")),
-                ERL_DRV_ATOM, driver_mk_atom(erl_errno_id(err)),
-                ERL_DRV_TUPLE, 2,
-                ERL_DRV_TUPLE, 4,
-            };
-            driver_send_term(port, acc.caller, term, sizeof term/sizeof *term);
-            acceptor_queue.pop_front();
+            if (!acceptor_queue.empty()) {
+                accept_failed(err);
+            }
             return;
         }
     }
-    Server* server = new Server(sock, sockopts);
-    bool is_utp;
-    {
-        MutexLocker lock(utp_mutex);
-        is_utp = UTP_IsIncomingUTP(&UtpHandler::utp_incoming,
-                                   &UtpHandler::send_to, server,
-                                   buf, len, from, from.slen);
-    }
-    if (is_utp) {
-        Acceptor& acc = acceptor_queue.front();
-        MainHandler::del_monitor(acc.caller);
-        ErlDrvPort new_port = create_port(acc.caller, server);
-        server->set_port(new_port);
-        ErlDrvTermData term[] = {
-            ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("utp_async")),
-            ERL_DRV_PORT, driver_mk_port(port),
-            ERL_DRV_EXT2TERM, acc.ref, acc.ref.size(),
-            ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("ok")),
-            ERL_DRV_PORT, driver_mk_port(new_port),
-            ERL_DRV_TUPLE, 2,
-            ERL_DRV_TUPLE, 4,
-        };
-        driver_send_term(port, acc.caller, term, sizeof term/sizeof *term);
-        acceptor_queue.pop_front();
-    } else {
+    Server* server = new Server(sock, sockopts, engine);
+    Engine::Lock lock(engine);
+    UTP_IsIncomingUTP(engine->ctx, &UtpHandler::utp_incoming,
+                      &UtpHandler::send_to, server, buf, len, from, from.slen);
+    if (!server->live()) {
         ::close(sock);
         delete server;
+    } else if (!acceptor_queue.empty()) {
+        accept_next(server);
+    } else if (!hand_off(server)) {
+        enter_backlog(server);
+    }
+}
+
+void
+UtpDrv::Listener::input_ready_shared()
+{
+    int count = recv_batch.recv(udp_sock, sockopts.recv_batch);
+    if (count > 0) {
+        MutexLocker qlock(queue_mutex);
+        Engine::Lock lock(engine);
+        SendBatch::Scope batch(engine->send_batch);
+        for (int i = 0; i < count; ++i) {
+            // Datagrams for established connections are routed by libutp
+            // itself. A SYN only creates a new connection if somebody is
+            // waiting to accept it or there is room in the backlog.
+            UTPGotIncomingConnection* incoming = 0;
+            if (can_accept()) {
+                incoming = &Listener::utp_incoming;
+            } else if (is_syn(recv_batch.data(i), recv_batch.size(i))) {
+                ++backlog_drops;
+                continue;
+            }
+            const SockAddr& addr = recv_batch.addr(i);
+            UTP_IsIncomingUTP(engine->ctx, incoming, &Listener::send_to,
+                              this, recv_batch.data(i), recv_batch.size(i),
+                              addr, addr.slen);
+        }
     }
 }
 
+bool
+UtpDrv::Listener::can_accept() const
+{
+    // called with queue_mutex and engine->mutex held; stop sets closed
+    // under queue_mutex, and a closed Listener that still reads its
+    // socket for shared connections must not take on new ones
+    if (closed) {
+        return false;
+    }
+    return !acceptor_queue.empty() ||
+        backlog.size() < static_cast<size_t>(sockopts.backlog);
+}
+
+void
+UtpDrv::Listener::accepted(const Acceptor& acc, Server* server)
+{
+    ErlDrvPort new_port = create_port(acc.caller, server);
+    ErlDrvTermData term[] = {
+        ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("utp_async")),
+        ERL_DRV_PORT, driver_mk_port(port),
+        ERL_DRV_EXT2TERM, acc.ref, acc.ref.size(),
+        ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("ok")),
+        ERL_DRV_PORT, driver_mk_port(new_port),
+        ERL_DRV_TUPLE, 2,
+        ERL_DRV_TUPLE, 4,
+    };
+    driver_send_term(port, acc.caller, term, sizeof term/sizeof *term);
+    server->attach(new_port);
+}
+
+void
+UtpDrv::Listener::accept_next(Server* server)
+{
+    Acceptor& acc = acceptor_queue.front();
+    MainHandler::del_monitor(acc.caller);
+    accepted(acc, server);
+    acceptor_queue.pop_front();
+}
+
+void
+UtpDrv::Listener::enter_backlog(Server* server)
+{
+    UTPDRV_TRACER << "Listener::enter_backlog " << this << UTPDRV_TRACE_ENDL;
+    server->enter_backlog(this);
+    backlog.push_back(server);
+    backlog_depth = backlog.size();
+}
+
+bool
+UtpDrv::Listener::hand_off(Server* server)
+{
+    // called with queue_mutex and engine->mutex held. Taking a sibling's
+    // queue_mutex here would invert the lock order, so only try it; if
+    // the sibling is busy the connection waits in our backlog, where the
+    // sibling's next accept finds it.
+    if (group == 0) {
+        return false;
+    }
+    MutexLocker glock(group->mutex);
+    ShardGroup::Members::iterator it = group->members.begin();
+    for (; it != group->members.end(); ++it) {
+        Listener* sibling = *it;
+        if (sibling == this ||
+            erl_drv_mutex_trylock(sibling->queue_mutex) != 0) {
+            continue;
+        }
+        bool waiting = !sibling->acceptor_queue.empty();
+        if (waiting) {
+            UTPDRV_TRACER << "Listener::hand_off " << this << " to "
+                          << sibling << UTPDRV_TRACE_ENDL;
+            sibling->accept_next(server);
+        }
+        erl_drv_mutex_unlock(sibling->queue_mutex);
+        if (waiting) {
+            return true;
+        }
+    }
+    return false;
+}
+
+Server*
+UtpDrv::Listener::take_backlogged()
+{
+    // called with engine->mutex held
+    Backlog::iterator it = backlog.begin();
+    while (it != backlog.end() && !(*it)->live()) {
+        ++it;
+    }
+    if (it == backlog.end()) {
+        return 0;
+    }
+    Server* server = *it;
+    backlog.erase(it);
+    backlog_depth = backlog.size();
+    return server;
+}
+
+bool
+UtpDrv::Listener::accept_from_shards(const Acceptor& acc)
+{
+    // called with queue_mutex held. A sibling's backlog is guarded by the
+    // mutex of the sibling's engine, and taking that while holding the
+    // group mutex would invert the lock order, so only try it; a busy
+    // sibling's backlog is left for the next accept.
+    if (group == 0) {
+        return false;
+    }
+    MutexLocker glock(group->mutex);
+    ShardGroup::Members::iterator it = group->members.begin();
+    for (; it != group->members.end(); ++it) {
+        Listener* sibling = *it;
+        Engine* eng = sibling->engine;
+        if (sibling == this || erl_drv_mutex_trylock(eng->mutex) != 0) {
+            continue;
+        }
+        Server* server = sibling->take_backlogged();
+        if (server != 0) {
+            SendBatch::Scope batch(eng->send_batch);
+            accepted(acc, server);
+        }
+        eng->check_deadline();
+        erl_drv_mutex_unlock(eng->mutex);
+        if (server != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+UtpDrv::Listener::leave_group()
+{
+    // called with queue_mutex held
+    if (group != 0) {
+        if (group->leave(this)) {
+            delete group;
+        }
+        group = 0;
+    }
+}
+
+void
+UtpDrv::Listener::send_ports(ErlDrvTermData to, const Binary& ref,
+                             bool siblings)
+{
+    // Send {Ref, Ports} with the ports of all shards, or, for siblings,
+    // {Ref, {shards, Ports}} with the ports of all shards but this one
+    std::vector<ErlDrvTermData> term;
+    term.push_back(ERL_DRV_EXT2TERM);
+    term.push_back(static_cast<ErlDrvTermData>(ref));
+    term.push_back(ref.size());
+    if (siblings) {
+        term.push_back(ERL_DRV_ATOM);
+        term.push_back(driver_mk_atom(const_cast<char*>("shards")));
+    }
+    size_t count = 0;
+    if (group != 0) {
+        MutexLocker glock(group->mutex);
+        ShardGroup::Members::iterator it = group->members.begin();
+        for (; it != group->members.end(); ++it) {
+            if (!siblings || *it != this) {
+                term.push_back(ERL_DRV_PORT);
+                term.push_back(driver_mk_port((*it)->port));
+                ++count;
+            }
+        }
+    } else if (!siblings) {
+        term.push_back(ERL_DRV_PORT);
+        term.push_back(driver_mk_port(port));
+        ++count;
+    }
+    term.push_back(ERL_DRV_NIL);
+    term.push_back(ERL_DRV_LIST);
+    term.push_back(count+1);
+    if (siblings) {
+        term.push_back(ERL_DRV_TUPLE);
+        term.push_back(2);
+    }
+    term.push_back(ERL_DRV_TUPLE);
+    term.push_back(2);
+    driver_send_term(port, to, &term[0], term.size());
+}
+
+void
+UtpDrv::Listener::accept_failed(int err)
+{
+    Acceptor& acc = acceptor_queue.front();
+    MainHandler::del_monitor(acc.caller);
+    ErlDrvTermData term[] = {
+        ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("utp_async")),
+        ERL_DRV_PORT, driver_mk_port(port),
+        ERL_DRV_EXT2TERM, acc.ref, acc.ref.size(),
+        ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("error")),
+        ERL_DRV_ATOM, driver_mk_atom(erl_errno_id(err)),
+        ERL_DRV_TUPLE, 2,
+        ERL_DRV_TUPLE, 4,
+    };
+    driver_send_term(port, acc.caller, term, sizeof term/sizeof *term);
+    acceptor_queue.pop_front();
+}
+
+void
+UtpDrv::Listener::send_to(void* data, const byte* p, size_t len,
+                          const sockaddr* to, socklen_t slen)
+{
+    (static_cast<Listener*>(data))->do_send_to(p, len, to, slen);
+}
+
+void
+UtpDrv::Listener::send_to_v(void* data, const byte* p, size_t len,
+                            const UTPSlice* slices, size_t nslices,
+                            const sockaddr* to, socklen_t slen)
+{
+    (static_cast<Listener*>(data))->do_send_to_v(p, len, slices, nslices,
+                                                 to, slen);
+}
+
+void
+UtpDrv::Listener::send_error(void* data, int errcode)
+{
+    // Errors sending on an unconnected socket say nothing about any one
+    // connection, and uTP retransmits whatever was lost
+    UTPDRV_TRACER << "Listener::send_error " << data << ": error code "
+                  << errcode << UTPDRV_TRACE_ENDL;
+}
+
+void
+UtpDrv::Listener::utp_incoming(void* data, UTPSocket* utp)
+{
+    (static_cast<Listener*>(data))->do_incoming(utp);
+}
+
+void
+UtpDrv::Listener::do_send_to(const byte* p, size_t len,
+                             const sockaddr* to, socklen_t slen)
+{
+    UTPDRV_TRACER << "Listener::do_send_to " << this << UTPDRV_TRACE_ENDL;
+    engine->send_batch.push(udp_sock, p, len, to, slen, gso_flag(),
+                            &Listener::send_error, this);
+}
+
+void
+UtpDrv::Listener::do_send_to_v(const byte* p, size_t len,
+                               const UTPSlice* slices, size_t nslices,
+                               const sockaddr* to, socklen_t slen)
+{
+    UTPDRV_TRACER << "Listener::do_send_to_v " << this << UTPDRV_TRACE_ENDL;
+    // the shared socket is unconnected, so every datagram carries the
+    // peer address; MSG_ZEROCOPY is only used on sockets a connection
+    // reads itself
+    engine->send_batch.push(udp_sock, p, len, slices, nslices, to, slen,
+                            gso_flag(), &Listener::send_error, this);
+}
+
 void
 UtpDrv::Listener::process_exited(const ErlDrvMonitor* mon, ErlDrvTermData proc)
 {
@@ -180,13 +552,55 @@ void
 UtpDrv::Listener::do_incoming(UTPSocket* utp)
 {
     UTPDRV_TRACER << "Listener::do_incoming " << this << UTPDRV_TRACE_ENDL;
+    // only called from input_ready_shared, with queue_mutex and
+    // engine->mutex held and either an acceptor waiting or room in the
+    // backlog
+    Server* server = new Server(udp_sock, sockopts, engine, this);
+    {
+        MutexLocker rlock(ref_mutex);
+        ++users;
+    }
+    UtpHandler::utp_incoming(server, utp);
+    if (!acceptor_queue.empty()) {
+        accept_next(server);
+    } else if (!hand_off(server)) {
+        enter_backlog(server);
+    }
 }
 
 ErlDrvSSizeT
 UtpDrv::Listener::close(const char* buf, ErlDrvSizeT len,
                         char** rbuf, ErlDrvSizeT rlen)
 {
+    UTPDRV_TRACER << "Listener::close " << this << UTPDRV_TRACE_ENDL;
     const char* retval = "ok";
+    MutexLocker qlock(queue_mutex);
+    if (group != 0) {
+        bool first;
+        {
+            MutexLocker glock(group->mutex);
+            first = group->members.size() > 1 &&
+                group->members.front() == this;
+        }
+        if (first) {
+            // closing the first shard closes them all, so tell the caller
+            // which other ports to close
+            Binary ref;
+            try {
+                EiDecoder decoder(buf, len);
+                int type, size;
+                decoder.type(type, size);
+                if (type != ERL_BINARY_EXT) {
+                    return reinterpret_cast<ErlDrvSSizeT>(ERL_DRV_ERROR_BADARG);
+                }
+                ref.decode(decoder, size);
+            } catch (const EiError&) {
+                return reinterpret_cast<ErlDrvSSizeT>(ERL_DRV_ERROR_BADARG);
+            }
+            send_ports(driver_caller(port), ref, true);
+            retval = "wait";
+        }
+    }
     EiEncoder encoder;
     encoder.atom(retval);
     ErlDrvBinary** binptr = reinterpret_cast<ErlDrvBinary**>(rbuf);
@@ -219,9 +633,22 @@ UtpDrv::Listener::accept(const char* buf, ErlDrvSizeT len,
         return reinterpret_cast<ErlDrvSSizeT>(ERL_DRV_ERROR_BADARG);
     }
     acc.caller = driver_caller(port);
-    if (MainHandler::add_monitor(acc.caller, this)) {
-        {
-            MutexLocker qlock(queue_mutex);
+    MutexLocker qlock(queue_mutex);
+    bool from_backlog = false;
+    {
+        Engine::Lock lock(engine);
+        Server* server = take_backlogged();
+        if (server != 0) {
+            SendBatch::Scope batch(engine->send_batch);
+            accepted(acc, server);
+            from_backlog = true;
+        }
+    }
+    if (!from_backlog) {
+        from_backlog = accept_from_shards(acc);
+    }
+    if (from_backlog || MainHandler::add_monitor(acc.caller, this)) {
+        if (!from_backlog) {
             acceptor_queue.push_back(acc);
         }
         EiEncoder encoder;
@@ -263,3 +690,25 @@ UtpDrv::Listener::cancel_accept(const char* buf, ErlDrvSizeT len,
     }
     return 0;
 }
+
+ErlDrvSSizeT
+UtpDrv::Listener::shards(const char* buf, ErlDrvSizeT len,
+                         char** rbuf, ErlDrvSizeT rlen)
+{
+    UTPDRV_TRACER << "Listener::shards " << this << UTPDRV_TRACE_ENDL;
+    Binary ref;
+    try {
+        EiDecoder decoder(buf, len);
+        int type, size;
+        decoder.type(type, size);
+        if (type != ERL_BINARY_EXT) {
+            return reinterpret_cast<ErlDrvSSizeT>(ERL_DRV_ERROR_BADARG);
+        }
+        ref.decode(decoder, size);
+    } catch (const EiError&) {
+        return reinterpret_cast<ErlDrvSSizeT>(ERL_DRV_ERROR_BADARG);
+    }
+    MutexLocker qlock(queue_mutex);
+    send_ports(driver_caller(port), ref, false);
+    return 0;
+}
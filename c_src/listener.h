@@ -24,6 +24,7 @@
 // -------------------------------------------------------------------
 
 #include <list>
+#include <vector>
 #include "socket_handler.h"
 #include "utils.h"
 #include "libutp/utp.h"
@@ -32,11 +33,53 @@
 namespace UtpDrv {
 
 class Server;
+class Listener;
+
+// The Listeners opened by a single listen call with the shards option,
+// each reading its own SO_REUSEPORT socket bound to the same address. The
+// kernel spreads datagrams across the sockets by peer address, and every
+// shard keeps its own acceptor queue and backlog. A shard with nobody
+// accepting hands a new connection to a sibling with a waiting acceptor
+// if it can, and an accept on a shard with an empty backlog takes a
+// connection waiting on a sibling.
+class ShardGroup
+{
+public:
+    ShardGroup();
+    ~ShardGroup();
+
+    void join(Listener* lsnr);
+
+    // returns true if the group is left empty and can be deleted
+    bool leave(Listener* lsnr);
+
+    typedef std::vector<Listener*> Members;
+    Members members;
+    ErlDrvMutex* mutex;
+
+private:
+    // prevent copies
+    ShardGroup(const ShardGroup&);
+    void operator=(const ShardGroup&);
+};
 
+// A Listener normally hands each accepted connection its own UDP socket,
+// bound to the listen address with SO_REUSEPORT and connected to the peer.
+// With the shared_socket option it instead keeps reading every datagram
+// from its own socket and lets libutp route each one to the right
+// connection by peer address and connection id, so that an accepted
+// connection costs no file descriptor. Servers accepted that way hold a
+// reference to the Listener, which stays alive, still reading the socket,
+// until the last of them goes away.
+//
+// If a connection arrives while nobody is accepting, the uTP handshake is
+// still completed and the Server waits in a backlog, bounded by the
+// backlog option, for the next accept call. Connection attempts beyond
+// that are dropped and counted.
 class Listener : public SocketHandler
 {
 public:
-    Listener(int sock, const SockOpts& so);
+    Listener(int sock, const SockOpts& so, ShardGroup* grp = 0);
     ~Listener();
 
     ErlDrvSSizeT
@@ -51,6 +94,20 @@ public:
 
     void process_exited(const ErlDrvMonitor* mon, ErlDrvTermData proc);
 
+    // drop a reference taken by a Server sharing our socket
+    void release();
+
+    // forget a backlogged Server that is being destroyed
+    void backlog_drop(Server* server);
+
+    static void send_to(void* data, const byte* p, size_t len,
+                        const sockaddr* to, socklen_t slen);
+    static void send_to_v(void* data, const byte* p, size_t len,
+                          const UTPSlice* slices, size_t nslices,
+                          const sockaddr* to, socklen_t slen);
+    static void send_error(void* data, int errcode);
+    static void utp_incoming(void* data, UTPSocket* utp);
+
 protected:
     ErlDrvSSizeT close(const char* buf, ErlDrvSizeT len,
                        char** rbuf, ErlDrvSizeT rlen);
@@ -64,17 +121,50 @@ protected:
     ErlDrvSSizeT cancel_accept(const char* buf, ErlDrvSizeT len,
                                char** rbuf, ErlDrvSizeT rlen);
 
+    ErlDrvSSizeT shards(const char* buf, ErlDrvSizeT len,
+                        char** rbuf, ErlDrvSizeT rlen);
+
 private:
     struct Acceptor {
         ErlDrvTermData caller;
         Binary ref;
     };
     typedef std::list<Acceptor> AcceptorQueue;
+    typedef std::list<Server*> Backlog;
 
+    // Lock order is queue_mutex, then engine->mutex, then the shard group
+    // mutex or ref_mutex; a sibling's queue_mutex or engine mutex is only
+    // ever tried. The backlog is guarded by engine->mutex since Servers
+    // leave it from libutp callbacks.
     AcceptorQueue acceptor_queue;
+    Backlog backlog;
     SockAddr my_addr;
+    ShardGroup* group;
     ErlDrvMutex* queue_mutex;
-
+    ErlDrvMutex* ref_mutex;
+    int users;
+    // set by stop with both queue_mutex and ref_mutex held, so either
+    // one is enough to read it
+    bool closed;
+
+    void input_ready_per_connection();
+    void input_ready_shared();
+    bool can_accept() const;
+    void accepted(const Acceptor& acc, Server* server);
+    void accept_next(Server* server);
+    void accept_failed(int err);
+    void enter_backlog(Server* server);
+    bool hand_off(Server* server);
+    Server* take_backlogged();
+    bool accept_from_shards(const Acceptor& acc);
+    void leave_group();
+    void send_ports(ErlDrvTermData to, const Binary& ref, bool siblings);
+
+    void do_send_to(const byte* p, size_t len, const sockaddr* to,
+                    socklen_t slen);
+    void do_send_to_v(const byte* p, size_t len,
+                      const UTPSlice* slices, size_t nslices,
+                      const sockaddr* to, socklen_t slen);
     void do_write(byte* bytes, size_t count);
     void do_incoming(UTPSocket* utp);
 
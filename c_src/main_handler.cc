@@ -21,24 +21,34 @@
 // -------------------------------------------------------------------
 
 #include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#if defined(__linux__)
+#include <sys/timerfd.h>
+#endif
+#include <vector>
 #include "main_handler.h"
+#include "udp_batch.h"
+#include "engine.h"
 #include "globals.h"
 #include "locker.h"
 #include "libutp/utp.h"
 #include "utp_handler.h"
 #include "client.h"
 #include "listener.h"
+#include "shared_socket.h"
 
 
 using namespace UtpDrv;
 
-const unsigned long timeout_check = 10;
-
 UtpDrv::MainHandler* UtpDrv::MainHandler::main_handler = 0;
+ErlDrvMutex* UtpDrv::MainHandler::wake_mutex = 0;
 
-UtpDrv::MainHandler::MainHandler(ErlDrvPort p) :
-    Handler(p), map_mutex(0)
+UtpDrv::MainHandler::MainHandler(ErlDrvPort p, bool hires) :
+    Handler(p), map_mutex(0), hires_timer(hires), timer_fd(INVALID_SOCKET)
 {
+    wake_fds[0] = wake_fds[1] = INVALID_SOCKET;
     set_port_control_flags(port, PORT_CONTROL_FLAG_BINARY);
 }
 
@@ -50,7 +60,9 @@ int
 UtpDrv::MainHandler::driver_init()
 {
     UTPDRV_TRACER << "MainHandler::driver_init\r\n";
-    utp_mutex = erl_drv_mutex_create(const_cast<char*>("utp"));
+    wake_mutex = erl_drv_mutex_create(const_cast<char*>("utpwake"));
+    Engine::driver_init();
+    SharedSocket::driver_init();
     return 0;
 }
 
@@ -58,21 +70,68 @@ void
 UtpDrv::MainHandler::driver_finish()
 {
     UTPDRV_TRACER << "MainHandler::driver_finish\r\n";
-    erl_drv_mutex_destroy(utp_mutex);
+    SharedSocket::driver_finish();
     delete main_handler;
     main_handler = 0;
+    Engine::driver_finish();
+    erl_drv_mutex_destroy(wake_mutex);
+    wake_mutex = 0;
 }
 
 void
 UtpDrv::MainHandler::check_utp_timeouts() const
 {
     if (main_handler != 0) {
-        MutexLocker lock(utp_mutex);
-        UTP_CheckTimeouts();
-        driver_set_timer(port, timeout_check);
+        Engine::check_timeouts();
+        arm_timer();
+    }
+}
+
+void
+UtpDrv::MainHandler::arm_timer() const
+{
+    long delay = Engine::next_timeout();
+    if (wake_fds[1] == INVALID_SOCKET &&
+        (delay < 0 || delay > UTP_TIMER_MIN_DELAY)) {
+        // without the wake pipe, deadlines added from other ports cannot
+        // rearm the timer, so fall back to ticking at the old period
+        delay = UTP_TIMER_MIN_DELAY;
+    }
+#if defined(__linux__)
+    if (timer_fd != INVALID_SOCKET) {
+        // an all-zero it_value disarms the timer
+        struct itimerspec its;
+        memset(&its, 0, sizeof its);
+        if (delay >= 0) {
+            its.it_value.tv_sec = delay / 1000;
+            its.it_value.tv_nsec = (delay % 1000) * 1000000L;
+        }
+        timerfd_settime(timer_fd, 0, &its, 0);
+        return;
+    }
+#endif
+    if (delay < 0) {
+        driver_cancel_timer(port);
+    } else {
+        driver_set_timer(port, delay);
     }
 }
 
+void
+UtpDrv::MainHandler::open_hires_timer()
+{
+#if defined(__linux__)
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        timer_fd = INVALID_SOCKET;
+        return;
+    }
+    driver_select(port, reinterpret_cast<ErlDrvEvent>(timer_fd),
+                  ERL_DRV_READ|ERL_DRV_USE, 1);
+    Engine::set_timer_min_delay(UTP_HIRES_TIMER_MIN_DELAY);
+#endif
+}
+
 ErlDrvSSizeT
 UtpDrv::MainHandler::control(unsigned command, const char* buf, ErlDrvSizeT len,
                              char** rbuf, ErlDrvSizeT rlen)
@@ -95,9 +154,27 @@ void
 UtpDrv::MainHandler::start()
 {
     UTPDRV_TRACER << "MainHandler::start\r\n";
-    driver_set_timer(port, timeout_check);
-    main_handler = this;
+    if (pipe(wake_fds) == 0) {
+        for (int i = 0; i < 2; ++i) {
+            int flags = fcntl(wake_fds[i], F_GETFL);
+            fcntl(wake_fds[i], F_SETFL, flags | O_NONBLOCK);
+        }
+        driver_select(port, reinterpret_cast<ErlDrvEvent>(wake_fds[0]),
+                      ERL_DRV_READ|ERL_DRV_USE, 1);
+    } else {
+        UTPDRV_TRACER << "MainHandler::start: no wake pipe, errno "
+                      << errno << UTPDRV_TRACE_ENDL;
+        wake_fds[0] = wake_fds[1] = INVALID_SOCKET;
+    }
+    if (hires_timer) {
+        open_hires_timer();
+    }
+    {
+        MutexLocker lock(wake_mutex);
+        main_handler = this;
+    }
     map_mutex = erl_drv_mutex_create(const_cast<char*>("utpmap"));
+    arm_timer();
 }
 
 void
@@ -105,13 +182,48 @@ UtpDrv::MainHandler::stop()
 {
     UTPDRV_TRACER << "MainHandler::stop\r\n";
     driver_cancel_timer(port);
+    {
+        // wake_timer may be writing the pipe from another port
+        MutexLocker lock(wake_mutex);
+        main_handler = 0;
+        if (wake_fds[1] != INVALID_SOCKET) {
+            ::close(wake_fds[1]);
+            wake_fds[1] = INVALID_SOCKET;
+        }
+    }
+    if (timer_fd != INVALID_SOCKET) {
+        // utp_stop_select closes the timerfd
+        driver_select(port, reinterpret_cast<ErlDrvEvent>(timer_fd),
+                      ERL_DRV_READ|ERL_DRV_USE, 0);
+        timer_fd = INVALID_SOCKET;
+        Engine::set_timer_min_delay(UTP_TIMER_MIN_DELAY);
+    }
+    if (wake_fds[0] != INVALID_SOCKET) {
+        // utp_stop_select closes the read end
+        driver_select(port, reinterpret_cast<ErlDrvEvent>(wake_fds[0]),
+                      ERL_DRV_READ|ERL_DRV_USE, 0);
+        wake_fds[0] = INVALID_SOCKET;
+    }
     erl_drv_mutex_destroy(map_mutex);
-    main_handler = 0;
 }
 
 void
 UtpDrv::MainHandler::ready_input(long fd)
 {
+    if (fd == wake_fds[0]) {
+        char buf[64];
+        while (::read(fd, buf, sizeof buf) > 0)
+            ;
+        arm_timer();
+        return;
+    }
+    if (fd == timer_fd) {
+        uint64_t expirations;
+        if (::read(fd, &expirations, sizeof expirations) > 0) {
+            check_utp_timeouts();
+        }
+        return;
+    }
     SocketHandler* hndlr = 0;
     {
         MutexLocker lock(map_mutex);
@@ -131,6 +243,12 @@ UtpDrv::MainHandler::outputv(ErlIOVec&)
     UTPDRV_TRACER << "MainHandler::outputv\r\n";
 }
 
+void
+UtpDrv::MainHandler::timeout()
+{
+    check_utp_timeouts();
+}
+
 void
 UtpDrv::MainHandler::process_exit(ErlDrvMonitor* monitor)
 {
@@ -178,6 +296,19 @@ UtpDrv::MainHandler::stop_input(int fd)
     }
 }
 
+void
+UtpDrv::MainHandler::wake_timer()
+{
+    MutexLocker lock(wake_mutex);
+    MainHandler* mh = main_handler;
+    if (mh != 0 && mh->wake_fds[1] != INVALID_SOCKET) {
+        // a full pipe already holds a pending wakeup, so EAGAIN is harmless
+        char c = 0;
+        ssize_t n = ::write(mh->wake_fds[1], &c, 1);
+        static_cast<void>(n);
+    }
+}
+
 bool
 UtpDrv::MainHandler::add_monitor(ErlDrvTermData proc, Handler* h)
 {
@@ -300,6 +431,7 @@ UtpDrv::MainHandler::connect_start(const char* buf, ErlDrvSizeT len,
 
     SocketHandler::SockOpts opts;
     opts.decode(binopts);
+    SharedSocket* shared = 0;
     int udp_sock, err;
     if (opts.fd != INVALID_SOCKET) {
         udp_sock = opts.fd;
@@ -309,6 +441,21 @@ UtpDrv::MainHandler::connect_start(const char* buf, ErlDrvSizeT len,
         } else {
             err = 0;
         }
+    } else if (opts.shared_socket) {
+        SockAddr local(INADDR_ANY, opts.port);
+        if (opts.addr_set) {
+            local = opts.addr;
+        } else if (opts.inet6) {
+            local.from_addrport("::", opts.port);
+        }
+        if (!Client::shared_opts_supported(opts)) {
+            err = EINVAL;
+        } else {
+            shared = SharedSocket::acquire(local, opts, err);
+            if (shared != 0) {
+                udp_sock = shared->socket();
+            }
+        }
     } else if (opts.addr_set) {
         err = SocketHandler::open_udp_socket(udp_sock, opts.addr);
     } else if (opts.inet6) {
@@ -327,7 +474,7 @@ UtpDrv::MainHandler::connect_start(const char* buf, ErlDrvSizeT len,
         };
         driver_send_term(port, caller, term, sizeof term/sizeof *term);
     } else {
-        Client* client = new Client(udp_sock, opts, ref);
+        Client* client = new Client(udp_sock, opts, ref, shared);
         ErlDrvPort new_port = create_port(caller, client);
         client->set_port(new_port);
         client->connect_to(addr);
@@ -392,6 +539,30 @@ UtpDrv::MainHandler::listen(const char* buf, ErlDrvSizeT len,
     } else {
         err = SocketHandler::open_udp_socket(udp_sock, opts.port, true);
     }
+    std::vector<int> socks;
+    if (err == 0) {
+        socks.push_back(udp_sock);
+        if (opts.shards > 1 && opts.fd == INVALID_SOCKET) {
+            // bind the other shards to the address the first one got, so
+            // that they all join its SO_REUSEPORT group
+            SockAddr bound;
+            if (getsockname(udp_sock, bound, &bound.slen) < 0) {
+                err = errno;
+            }
+            while (err == 0 && socks.size() < size_t(opts.shards)) {
+                int sock;
+                err = SocketHandler::open_udp_socket(sock, bound, true);
+                if (err == 0) {
+                    socks.push_back(sock);
+                }
+            }
+            if (err != 0) {
+                for (size_t i = 0; i < socks.size(); ++i) {
+                    ::close(socks[i]);
+                }
+            }
+        }
+    }
     if (err != 0) {
         ErlDrvTermData term[] = {
             ERL_DRV_EXT2TERM, ref, ref.size(),
@@ -402,9 +573,17 @@ UtpDrv::MainHandler::listen(const char* buf, ErlDrvSizeT len,
         };
         driver_send_term(port, caller, term, sizeof term/sizeof *term);
     } else {
-        Listener* listener = new Listener(udp_sock, opts);
-        ErlDrvPort new_port = create_port(caller, listener);
-        listener->set_port(new_port);
+        // with more than one shard, the first port stands for the group
+        ShardGroup* group = socks.size() > 1 ? new ShardGroup : 0;
+        ErlDrvPort new_port = 0;
+        for (size_t i = 0; i < socks.size(); ++i) {
+            Listener* listener = new Listener(socks[i], opts, group);
+            ErlDrvPort shard_port = create_port(caller, listener);
+            listener->set_port(shard_port);
+            if (i == 0) {
+                new_port = shard_port;
+            }
+        }
         ErlDrvTermData term[] = {
             ERL_DRV_EXT2TERM, ref, ref.size(),
             ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("ok")),
@@ -36,7 +36,7 @@ namespace UtpDrv {
 class MainHandler : public Handler
 {
 public:
-    explicit MainHandler(ErlDrvPort p);
+    MainHandler(ErlDrvPort p, bool hires);
     ~MainHandler();
 
     static int driver_init();
@@ -52,6 +52,7 @@ public:
     void stop();
     void ready_input(long fd);
     void outputv(ErlIOVec& ev);
+    void timeout();
     void process_exit(ErlDrvMonitor* monitor);
 
     static ErlDrvPort drv_port();
@@ -63,10 +64,18 @@ public:
     static void del_monitor(ErlDrvTermData proc);
     static void del_monitors(Handler* h);
 
+    // Ask the main port to rearm its timer for an earlier libutp deadline.
+    // Safe to call from any thread.
+    static void wake_timer();
+
 private:
     // MainHandler singleton
     static MainHandler* main_handler;
 
+    // guards main_handler and its wake pipe's write end against stop
+    // while wake_timer runs on other ports' threads
+    static ErlDrvMutex* wake_mutex;
+
     ErlDrvTermData owner;
 
     struct MonCompare {
@@ -78,6 +87,14 @@ private:
 
     ErlDrvMutex* map_mutex;
 
+    // self-pipe other threads write to so the main port rearms its timer
+    int wake_fds[2];
+
+    // timerfd used instead of the driver timer when the driver is started
+    // with hires_timer, or INVALID_SOCKET
+    bool hires_timer;
+    int timer_fd;
+
     typedef std::map<int, SocketHandler*> FdMap;
     FdMap fdmap;
     typedef std::map<ErlDrvMonitor, Handler*, MonCompare> MonMap;
@@ -92,6 +109,9 @@ private:
     ErlDrvSSizeT
     listen(const char* buf, ErlDrvSizeT len, char** rbuf, ErlDrvSizeT rlen);
 
+    void arm_timer() const;
+    void open_hires_timer();
+
     void select(int fd, SocketHandler* handler);
     void deselect(int& fd);
 
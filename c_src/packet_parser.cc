@@ -0,0 +1,91 @@
+// -------------------------------------------------------------------
+//
+// packet_parser.cc: incremental framing of uTP read data
+//
+// Copyright (c) 2012-2013 Basho Technologies, Inc. All Rights Reserved.
+//
+// This file is provided to you under the Apache License,
+// Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License.  You may obtain
+// a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+//
+// -------------------------------------------------------------------
+
+#include "packet_parser.h"
+
+
+using namespace UtpDrv;
+
+UtpDrv::PacketParser::PacketParser() :
+    size(0), scanned(0), max(0), packet(0),
+    delimiter(UTP_LINE_DELIMITER_DEFAULT), sized(false), too_big(false)
+{
+}
+
+UtpDrv::PacketParser::Result
+UtpDrv::PacketParser::parse(const ReadQueue& queue, unsigned char pkt,
+                            unsigned long max_size, unsigned char delim)
+{
+    if (pkt != packet || max_size != max || delim != delimiter) {
+        packet = pkt;
+        max = max_size;
+        delimiter = delim;
+        reset();
+    }
+    if (too_big) {
+        return TOO_BIG;
+    }
+    if (!sized) {
+        if (packet == UTP_PACKET_LINE) {
+            size_t pos = queue.find(delimiter, scanned);
+            if (pos == queue.size()) {
+                scanned = pos;
+                if (max != 0 && scanned >= max) {
+                    too_big = true;
+                    return TOO_BIG;
+                }
+                return INCOMPLETE;
+            }
+            size = pos + 1;
+        } else {
+            unsigned char hdr[4];
+            if (queue.peek(hdr, packet) < packet) {
+                return INCOMPLETE;
+            }
+            switch (packet) {
+            case 1:
+                size = hdr[0];
+                break;
+            case 2:
+                size = (hdr[0] << 8) | hdr[1];
+                break;
+            case 4:
+                size = (uint32_t(hdr[0]) << 24) | (uint32_t(hdr[1]) << 16) |
+                    (hdr[2] << 8) | hdr[3];
+                break;
+            }
+        }
+        sized = true;
+        if (max != 0 && size > max) {
+            too_big = true;
+            return TOO_BIG;
+        }
+    }
+    return queue.size() < header_size() + size ? INCOMPLETE : COMPLETE;
+}
+
+void
+UtpDrv::PacketParser::consumed()
+{
+    size = scanned = 0;
+    sized = false;
+}
@@ -0,0 +1,95 @@
+#ifndef UTPDRV_PACKET_PARSER_H
+#define UTPDRV_PACKET_PARSER_H
+
+// -------------------------------------------------------------------
+//
+// packet_parser.h: incremental framing of uTP read data
+//
+// Copyright (c) 2012-2013 Basho Technologies, Inc. All Rights Reserved.
+//
+// This file is provided to you under the Apache License,
+// Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License.  You may obtain
+// a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+//
+// -------------------------------------------------------------------
+
+#include "read_queue.h"
+
+
+namespace UtpDrv {
+
+// Value of the packet socket option for delimiter-terminated frames; the
+// other values are 0 for none and 1, 2 or 4 for a length header of that
+// many bytes
+const unsigned char UTP_PACKET_LINE = 255;
+
+// Default for the line_delimiter socket option
+const unsigned char UTP_LINE_DELIMITER_DEFAULT = '\n';
+
+// PacketParser finds the frame at the front of a ReadQueue for the packet
+// socket option. It remembers what it has learned about that frame, a
+// decoded length header or how far a line has been scanned without finding
+// its end, so data trickling in is examined only once however it is split
+// across reads. Frames longer than the packet_size option, if set, are
+// refused as soon as that is known rather than buffered.
+class PacketParser
+{
+public:
+    enum Result {
+        INCOMPLETE,
+        COMPLETE,
+        TOO_BIG
+    };
+
+    PacketParser();
+
+    // Look for a whole frame at the front of queue. On COMPLETE, the frame
+    // is header_size() bytes of framing followed by frame_size() bytes of
+    // data, which for a line include the delimiter. Once a frame is too big
+    // the result stays TOO_BIG until the framing options change.
+    Result parse(const ReadQueue& queue, unsigned char packet,
+                 unsigned long max_size,
+                 unsigned char delimiter = UTP_LINE_DELIMITER_DEFAULT);
+
+    size_t header_size() const {
+        return packet == UTP_PACKET_LINE ? 0 : packet;
+    }
+    size_t frame_size() const { return size; }
+
+    // true once a frame has been found too big
+    bool failed() const { return too_big; }
+
+    // The caller has removed the frame parse found from the queue
+    void consumed();
+
+    // The queue has been emptied
+    void reset() { consumed(); too_big = false; }
+
+private:
+    size_t size, scanned;
+    unsigned long max;
+    unsigned char packet, delimiter;
+    bool sized, too_big;
+};
+
+}
+
+
+// this block comment is for emacs, do not delete
+// Local Variables:
+// mode: c++
+// c-file-style: "stroustrup"
+// c-file-offsets: ((innamespace . 0))
+// End:
+
+#endif
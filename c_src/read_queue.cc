@@ -0,0 +1,161 @@
+// -------------------------------------------------------------------
+//
+// read_queue.cc: queue for uTP read data
+//
+// Copyright (c) 2012-2013 Basho Technologies, Inc. All Rights Reserved.
+//
+// This file is provided to you under the Apache License,
+// Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License.  You may obtain
+// a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+//
+// -------------------------------------------------------------------
+//
+// -------------------------------------------------------------------
+
+#include <string.h>
+#include "read_queue.h"
+
+
+using namespace UtpDrv;
+
+UtpDrv::ReadQueue::ReadQueue() : slab(0), slab_used(0), sz(0)
+{
+}
+
+UtpDrv::ReadQueue::~ReadQueue()
+{
+    clear();
+    if (slab != 0) {
+        driver_free_binary(slab);
+    }
+}
+
+void
+UtpDrv::ReadQueue::push_back(const void* bytes, size_t count)
+{
+    if (count == 0) {
+        return;
+    }
+    if (slab != 0 && sz == 0 && driver_binary_get_refc(slab) == 1) {
+        // nothing else refers to the slab, so start over at its beginning
+        slab_used = 0;
+    }
+    if (slab != 0 && slab_used + count > size_t(slab->orig_size)) {
+        driver_free_binary(slab);
+        slab = 0;
+    }
+    if (slab == 0) {
+        size_t slab_size = count > UTP_READ_SLAB_SIZE ? count : UTP_READ_SLAB_SIZE;
+        slab = driver_alloc_binary(slab_size);
+        slab_used = 0;
+    }
+    memcpy(slab->orig_bytes + slab_used, bytes, count);
+    if (!queue.empty() && queue.back().bin == slab &&
+        queue.back().offset + queue.back().len == slab_used) {
+        queue.back().len += count;
+    } else {
+        Segment seg;
+        seg.bin = slab;
+        seg.offset = slab_used;
+        seg.len = count;
+        driver_binary_inc_refc(slab);
+        queue.push_back(seg);
+    }
+    slab_used += count;
+    sz += count;
+}
+
+size_t
+UtpDrv::ReadQueue::peek(void* buf, size_t count) const
+{
+    char* to = reinterpret_cast<char*>(buf);
+    size_t total = 0;
+    SegmentQueue::const_iterator it = queue.begin();
+    for (; it != queue.end() && total < count; ++it) {
+        size_t to_copy = count - total;
+        if (to_copy > it->len) {
+            to_copy = it->len;
+        }
+        memcpy(to + total, it->bin->orig_bytes + it->offset, to_copy);
+        total += to_copy;
+    }
+    return total;
+}
+
+size_t
+UtpDrv::ReadQueue::find(unsigned char c, size_t from) const
+{
+    size_t pos = 0;
+    SegmentQueue::const_iterator it = queue.begin();
+    for (; it != queue.end(); pos += it->len, ++it) {
+        if (pos + it->len <= from) {
+            continue;
+        }
+        size_t skip = from > pos ? from - pos : 0;
+        const char* p = it->bin->orig_bytes + it->offset;
+        const void* hit = memchr(p + skip, c, it->len - skip);
+        if (hit != 0) {
+            return pos + (static_cast<const char*>(hit) - p);
+        }
+    }
+    return sz;
+}
+
+ErlDrvBinary*
+UtpDrv::ReadQueue::take(size_t count, size_t& offset)
+{
+    if (!queue.empty() && queue.front().len >= count) {
+        Segment& seg = queue.front();
+        ErlDrvBinary* bin = seg.bin;
+        driver_binary_inc_refc(bin);
+        offset = seg.offset;
+        drop(count);
+        return bin;
+    }
+    // the data spans slabs, or the queue is empty and count is 0, so it has
+    // to be copied
+    ErlDrvBinary* bin = driver_alloc_binary(count);
+    peek(bin->orig_bytes, count);
+    drop(count);
+    offset = 0;
+    return bin;
+}
+
+void
+UtpDrv::ReadQueue::drop(size_t count)
+{
+    while (count > 0 && !queue.empty()) {
+        Segment& seg = queue.front();
+        if (seg.len > count) {
+            seg.offset += count;
+            seg.len -= count;
+            sz -= count;
+            break;
+        }
+        count -= seg.len;
+        sz -= seg.len;
+        driver_free_binary(seg.bin);
+        queue.pop_front();
+    }
+}
+
+void
+UtpDrv::ReadQueue::clear()
+{
+    SegmentQueue::iterator it = queue.begin();
+    for (; it != queue.end(); ++it) {
+        driver_free_binary(it->bin);
+    }
+    queue.clear();
+    sz = 0;
+}
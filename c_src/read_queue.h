@@ -0,0 +1,95 @@
+#ifndef UTPDRV_READ_QUEUE_H
+#define UTPDRV_READ_QUEUE_H
+
+// -------------------------------------------------------------------
+//
+// read_queue.h: queue for uTP read data
+//
+// Copyright (c) 2012-2013 Basho Technologies, Inc. All Rights Reserved.
+//
+// This file is provided to you under the Apache License,
+// Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License.  You may obtain
+// a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+//
+// -------------------------------------------------------------------
+//
+// -------------------------------------------------------------------
+
+#include <deque>
+#include "erl_driver.h"
+
+
+namespace UtpDrv {
+
+// Size of the binaries incoming data is copied into. Messages are handed to
+// Erlang as sub-binaries of these, so a slab stays alive until every
+// message cut from it has been garbage collected.
+const size_t UTP_READ_SLAB_SIZE = 65536;
+
+// ReadQueue holds data received from libutp until it is delivered. Each
+// push copies the data into the tail of a large refcounted slab, and take
+// returns a reference to the slab rather than a copy whenever the bytes
+// requested lie within a single slab.
+class ReadQueue
+{
+public:
+    ReadQueue();
+    ~ReadQueue();
+
+    void push_back(const void* bytes, size_t count);
+
+    // Copy up to count bytes from the front of the queue without removing
+    // them, returning the number copied
+    size_t peek(void* to, size_t count) const;
+
+    // Return the position of the first byte equal to c at or after from,
+    // or size() if there is none
+    size_t find(unsigned char c, size_t from) const;
+
+    // Remove count bytes from the front of the queue and return a binary
+    // holding them at offset. The caller owns a reference to the binary.
+    ErlDrvBinary* take(size_t count, size_t& offset);
+
+    void drop(size_t count);
+
+    size_t size() const { return sz; }
+
+    void clear();
+
+private:
+    struct Segment {
+        ErlDrvBinary* bin;
+        size_t offset, len;
+    };
+    typedef std::deque<Segment> SegmentQueue;
+    SegmentQueue queue;
+    ErlDrvBinary* slab;
+    size_t slab_used, sz;
+
+    // prevent copies
+    ReadQueue(const ReadQueue&);
+    void operator=(const ReadQueue&);
+};
+
+}
+
+
+
+// this block comment is for emacs, do not delete
+// Local Variables:
+// mode: c++
+// c-file-style: "stroustrup"
+// c-file-offsets: ((innamespace . 0))
+// End:
+
+#endif
@@ -24,12 +24,16 @@
 #include "listener.h"
 #include "globals.h"
 #include "locker.h"
+#include "main_handler.h"
+#include "udp_batch.h"
+#include "engine.h"
 
 
 using namespace UtpDrv;
 
-UtpDrv::Server::Server(int sock, const SockOpts& so) :
-    UtpHandler(sock, so)
+UtpDrv::Server::Server(int sock, const SockOpts& so, Engine* eng,
+                       Listener* lsnr) :
+    UtpHandler(sock, so, eng), owner(lsnr), backlogged(0)
 {
     UTPDRV_TRACER << "Server::Server " << this
                   << ", socket " << sock << UTPDRV_TRACE_ENDL;
@@ -38,6 +42,55 @@ UtpDrv::Server::Server(int sock, const SockOpts& so) :
 UtpDrv::Server::~Server()
 {
     UTPDRV_TRACER << "Server::~Server " << this << UTPDRV_TRACE_ENDL;
+    if (owner != 0) {
+        owner->release();
+    }
+}
+
+void
+UtpDrv::Server::set_port(ErlDrvPort p)
+{
+    UTPDRV_TRACER << "Server::set_port " << this << UTPDRV_TRACE_ENDL;
+    if (owner != 0) {
+        // the owning Listener reads the shared socket for us
+        Handler::set_port(p);
+    } else {
+        UtpHandler::set_port(p);
+    }
+}
+
+void
+UtpDrv::Server::enter_backlog(Listener* lsnr)
+{
+    UTPDRV_TRACER << "Server::enter_backlog " << this << UTPDRV_TRACE_ENDL;
+    backlogged = lsnr;
+    if (owner == 0 && !selected) {
+        // our connected socket has to be read even before we have a port
+        MainHandler::start_input(udp_sock, this);
+        selected = true;
+    }
+}
+
+void
+UtpDrv::Server::attach(ErlDrvPort p)
+{
+    UTPDRV_TRACER << "Server::attach " << this << UTPDRV_TRACE_ENDL;
+    backlogged = 0;
+    set_port(p);
+    if (!pending.empty()) {
+        ustring data;
+        data.swap(pending);
+        UtpHandler::do_read(data.data(), data.size());
+    }
+}
+
+void
+UtpDrv::Server::abandon()
+{
+    UTPDRV_TRACER << "Server::abandon " << this << UTPDRV_TRACE_ENDL;
+    backlogged = 0;
+    close_utp();
+    status = stopped;
 }
 
 void
@@ -46,19 +99,22 @@ UtpDrv::Server::do_send_to(const byte* p, size_t len,
 {
     UTPDRV_TRACER << "Server::do_send_to " << this << UTPDRV_TRACE_ENDL;
     if (udp_sock != INVALID_SOCKET) {
-        int index = 0;
-        for (;;) {
-            ssize_t count = send(udp_sock, p+index, len-index, 0);
-            if (count == ssize_t(len-index)) {
-                break;
-            } else if (count < 0 && errno != EINTR &&
-                       errno != EAGAIN && errno != EWOULDBLOCK) {
-                do_error(errno);
-                break;
-            } else {
-                index += count;
-            }
-        }
+        // the socket is connected to the peer, so no address is needed
+        engine->send_batch.push(udp_sock, p, len, 0, 0, gso_flag(),
+                                &UtpHandler::utp_error, this);
+    }
+}
+
+void
+UtpDrv::Server::do_send_to_v(const byte* p, size_t len,
+                             const UTPSlice* slices, size_t nslices,
+                             const sockaddr* to, socklen_t slen)
+{
+    UTPDRV_TRACER << "Server::do_send_to_v " << this << UTPDRV_TRACE_ENDL;
+    if (udp_sock != INVALID_SOCKET) {
+        engine->send_batch.push(udp_sock, p, len, slices, nslices, 0, 0,
+                                gso_flag(), &UtpHandler::utp_error, this,
+                                zerocopy.active() ? &zerocopy : 0);
     }
 }
 
@@ -69,8 +125,81 @@ UtpDrv::Server::do_incoming(UTPSocket* utp_sock)
     UTPDRV_TRACER << "Server::do_incoming " << this << UTPDRV_TRACE_ENDL;
     if (utp == 0) {
         utp = utp_sock;
-        set_utp_callbacks();
+        // on a shared socket libutp sends through the owning Listener
+        set_utp_callbacks(owner != 0 ? &Listener::send_to_v :
+                          &UtpHandler::send_to_v);
         writable = true;
         status = connected;
     }
 }
+
+void
+UtpDrv::Server::do_read(const byte* bytes, size_t count)
+{
+    UTPDRV_TRACER << "Server::do_read " << this << UTPDRV_TRACE_ENDL;
+    if (backlogged != 0) {
+        pending.append(bytes, count);
+    } else {
+        UtpHandler::do_read(bytes, count);
+    }
+}
+
+size_t
+UtpDrv::Server::do_get_rb_size()
+{
+    UTPDRV_TRACER << "Server::do_get_rb_size " << this << UTPDRV_TRACE_ENDL;
+    if (backlogged != 0) {
+        return pending.size();
+    }
+    return UtpHandler::do_get_rb_size();
+}
+
+void
+UtpDrv::Server::do_state_change(int s)
+{
+    if (backlogged == 0) {
+        UtpHandler::do_state_change(s);
+        return;
+    }
+    UTPDRV_TRACER << "Server::do_state_change " << this
+                  << ": backlogged, new state: " << s << UTPDRV_TRACE_ENDL;
+    state = s;
+    switch (state) {
+    case UTP_STATE_EOF:
+        // the peer gave up before anybody accepted us
+        close_utp();
+        break;
+
+    case UTP_STATE_WRITABLE:
+        writable = true;
+        break;
+
+    case UTP_STATE_DESTROYING:
+        engine->send_batch.flush();
+        // the socket is about to be closed, and the kernel may still be
+        // reading the binaries of zero-copy sends
+        zerocopy.drain();
+        if (selected) {
+            MainHandler::stop_input(udp_sock);
+            selected = false;
+        }
+        backlogged->backlog_drop(this);
+        delete this;
+        break;
+    }
+}
+
+void
+UtpDrv::Server::do_error(int errcode)
+{
+    if (backlogged == 0) {
+        UtpHandler::do_error(errcode);
+        return;
+    }
+    UTPDRV_TRACER << "Server::do_error " << this << ": backlogged, error code "
+                  << errcode << UTPDRV_TRACE_ENDL;
+    error_code = errcode;
+    if (errcode == ECONNRESET) {
+        close_utp();
+    }
+}
@@ -29,15 +29,42 @@
 
 namespace UtpDrv {
 
+class Listener;
+
 class Server : public UtpHandler
 {
 public:
-    Server(int sock, const SockOpts& so);
+    // If owner is set, sock belongs to that Listener, which reads it and
+    // sends on behalf of this Server
+    Server(int sock, const SockOpts& so, Engine* eng, Listener* owner = 0);
     ~Server();
 
+    void set_port(ErlDrvPort p);
+
+    // Connections completed while nobody was accepting wait in their
+    // Listener's backlog without a port. Until attach gives them one,
+    // received data is held in pending and the connection is simply
+    // dropped if the peer goes away.
+    void enter_backlog(Listener* lsnr);
+    void attach(ErlDrvPort p);
+    void abandon();
+    bool live() const { return status == connected && utp != 0; }
+
 private:
+    Listener* owner;
+    Listener* backlogged;
+    ustring pending;
+
+    void do_read(const byte* bytes, size_t count);
+    size_t do_get_rb_size();
+    void do_state_change(int state);
+    void do_error(int errcode);
+
     void do_send_to(const byte* p, size_t len, const sockaddr* to,
                     socklen_t slen);
+    void do_send_to_v(const byte* p, size_t len,
+                      const UTPSlice* slices, size_t nslices,
+                      const sockaddr* to, socklen_t slen);
     void do_incoming(UTPSocket* utp);
 
     // prevent copies
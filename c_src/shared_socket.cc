@@ -0,0 +1,199 @@
+// -------------------------------------------------------------------
+//
+// shared_socket.cc: UDP socket shared by outbound uTP connections
+//
+// Copyright (c) 2012-2013 Basho Technologies, Inc. All Rights Reserved.
+//
+// This file is provided to you under the Apache License,
+// Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License.  You may obtain
+// a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+//
+// -------------------------------------------------------------------
+
+#include "shared_socket.h"
+#include "globals.h"
+#include "locker.h"
+#include "main_handler.h"
+#include "udp_batch.h"
+#include "engine.h"
+#include "utils.h"
+
+
+using namespace UtpDrv;
+
+UtpDrv::SharedSocket::Pool UtpDrv::SharedSocket::pool;
+ErlDrvMutex* UtpDrv::SharedSocket::pool_mutex = 0;
+
+UtpDrv::SharedSocket::SharedSocket(int sock, const SockOpts& so,
+                                   const SockAddr& addr) :
+    SocketHandler(sock, so, Engine::next()), key(addr, so.recv_batch),
+    users(0)
+{
+    UTPDRV_TRACER << "SharedSocket::SharedSocket " << this
+                  << ", socket " << sock << UTPDRV_TRACE_ENDL;
+    MainHandler::start_input(udp_sock, this);
+    selected = true;
+}
+
+UtpDrv::SharedSocket::~SharedSocket()
+{
+    UTPDRV_TRACER << "SharedSocket::~SharedSocket " << this << UTPDRV_TRACE_ENDL;
+}
+
+void
+UtpDrv::SharedSocket::driver_init()
+{
+    pool_mutex = erl_drv_mutex_create(const_cast<char*>("utp_shared_pool"));
+}
+
+void
+UtpDrv::SharedSocket::driver_finish()
+{
+    erl_drv_mutex_destroy(pool_mutex);
+    pool_mutex = 0;
+}
+
+UtpDrv::SharedSocket*
+UtpDrv::SharedSocket::acquire(const SockAddr& local, const SockOpts& so,
+                              int& err)
+{
+    UTPDRV_TRACER << "SharedSocket::acquire" << UTPDRV_TRACE_ENDL;
+    MutexLocker lock(pool_mutex);
+    PoolKey key(local, so.recv_batch);
+    std::pair<Pool::iterator, Pool::iterator> range = pool.equal_range(key);
+    SharedSocket* shared = 0;
+    int count = 0;
+    for (Pool::iterator it = range.first; it != range.second; ++it, ++count) {
+        if (shared == 0 || it->second->users < shared->users) {
+            shared = it->second;
+        }
+    }
+    if (count < UTP_SHARED_POOL_SIZE && (shared == 0 || shared->users > 0)) {
+        int sock;
+        err = open_udp_socket(sock, local);
+        if (err == 0) {
+            shared = new SharedSocket(sock, so, local);
+            pool.insert(Pool::value_type(key, shared));
+        } else if (shared == 0) {
+            return 0;
+        }
+    }
+    err = 0;
+    ++shared->users;
+    return shared;
+}
+
+void
+UtpDrv::SharedSocket::release()
+{
+    UTPDRV_TRACER << "SharedSocket::release " << this << UTPDRV_TRACE_ENDL;
+    {
+        MutexLocker lock(pool_mutex);
+        if (--users != 0) {
+            return;
+        }
+        std::pair<Pool::iterator, Pool::iterator> range =
+            pool.equal_range(key);
+        for (Pool::iterator it = range.first; it != range.second; ++it) {
+            if (it->second == this) {
+                pool.erase(it);
+                break;
+            }
+        }
+    }
+    if (selected) {
+        MainHandler::stop_input(udp_sock);
+        selected = false;
+    }
+    delete this;
+}
+
+ErlDrvSSizeT
+UtpDrv::SharedSocket::control(unsigned command, const char* buf,
+                              ErlDrvSizeT len, char** rbuf, ErlDrvSizeT rlen)
+{
+    UTPDRV_TRACER << "SharedSocket::control " << this << UTPDRV_TRACE_ENDL;
+    return encode_error(rbuf, rlen, "enotsup");
+}
+
+void
+UtpDrv::SharedSocket::outputv(ErlIOVec&)
+{
+    UTPDRV_TRACER << "SharedSocket::outputv " << this << UTPDRV_TRACE_ENDL;
+}
+
+void
+UtpDrv::SharedSocket::stop()
+{
+    // we have no port, and our lifetime is managed by release
+    UTPDRV_TRACER << "SharedSocket::stop " << this << UTPDRV_TRACE_ENDL;
+}
+
+void
+UtpDrv::SharedSocket::input_ready()
+{
+    UTPDRV_TRACER << "SharedSocket::input_ready " << this << UTPDRV_TRACE_ENDL;
+    int count = recv_batch.recv(udp_sock, sockopts.recv_batch);
+    if (count > 0) {
+        Engine::Lock lock(engine);
+        SendBatch::Scope batch(engine->send_batch);
+        for (int i = 0; i < count; ++i) {
+            // outbound connections only, so never accept a SYN
+            const SockAddr& addr = recv_batch.addr(i);
+            UTP_IsIncomingUTP(engine->ctx, 0, &SharedSocket::send_to, this,
+                              recv_batch.data(i), recv_batch.size(i),
+                              addr, addr.slen);
+        }
+    }
+}
+
+void
+UtpDrv::SharedSocket::send_to(void* data, const byte* p, size_t len,
+                              const sockaddr* to, socklen_t slen)
+{
+    (static_cast<SharedSocket*>(data))->do_send_to(p, len, to, slen);
+}
+
+void
+UtpDrv::SharedSocket::send_error(void* data, int errcode)
+{
+    // only resets for unknown connections are sent from here, so there is
+    // nobody to tell about a failure
+    UTPDRV_TRACER << "SharedSocket::send_error " << data << ": error code "
+                  << errcode << UTPDRV_TRACE_ENDL;
+}
+
+void
+UtpDrv::SharedSocket::do_send_to(const byte* p, size_t len,
+                                 const sockaddr* to, socklen_t slen)
+{
+    UTPDRV_TRACER << "SharedSocket::do_send_to " << this << UTPDRV_TRACE_ENDL;
+    engine->send_batch.push(udp_sock, p, len, to, slen, gso_flag(),
+                            &SharedSocket::send_error, this);
+}
+
+ErlDrvSSizeT
+UtpDrv::SharedSocket::close(const char* buf, ErlDrvSizeT len,
+                            char** rbuf, ErlDrvSizeT rlen)
+{
+    UTPDRV_TRACER << "SharedSocket::close " << this << UTPDRV_TRACE_ENDL;
+    return encode_error(rbuf, rlen, ENOTCONN);
+}
+
+ErlDrvSSizeT
+UtpDrv::SharedSocket::peername(const char* buf, ErlDrvSizeT len,
+                               char** rbuf, ErlDrvSizeT rlen)
+{
+    UTPDRV_TRACER << "SharedSocket::peername " << this << UTPDRV_TRACE_ENDL;
+    return encode_error(rbuf, rlen, ENOTCONN);
+}
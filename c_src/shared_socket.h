@@ -0,0 +1,118 @@
+#ifndef UTPDRV_SHARED_SOCKET_H
+#define UTPDRV_SHARED_SOCKET_H
+
+// -------------------------------------------------------------------
+//
+// shared_socket.h: UDP socket shared by outbound uTP connections
+//
+// Copyright (c) 2012-2013 Basho Technologies, Inc. All Rights Reserved.
+//
+// This file is provided to you under the Apache License,
+// Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License.  You may obtain
+// a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+//
+// -------------------------------------------------------------------
+
+#include <map>
+#include "socket_handler.h"
+#include "libutp/utp.h"
+
+
+namespace UtpDrv {
+
+// Maximum number of shared sockets opened for the same local address and
+// socket-level options
+const int UTP_SHARED_POOL_SIZE = 4;
+
+// A SharedSocket is a bound UDP socket used by many Client connections
+// opened with the shared_socket option. It has no port of its own; it
+// reads its socket on the Clients' behalf and lets libutp route each
+// datagram to the right connection by peer address and connection id.
+// SharedSockets are pooled per local address and reference counted by
+// the Clients using them; the last Client to go closes the socket.
+//
+// Options that act on the socket itself, so far only recv_batch, are part
+// of the pool key, so Clients asking for different values never share a
+// socket. gro and zerocopy cannot apply to a socket read on behalf of
+// many connections and are refused for shared Clients. Everything else,
+// including sndbuf, recbuf and gso, is kept per connection.
+class SharedSocket : public SocketHandler
+{
+public:
+    static void driver_init();
+    static void driver_finish();
+
+    // Return a referenced socket bound to local with the socket-level
+    // options of so, opening a new one if the pool for that address and
+    // those options is not yet full and all of its sockets are in use. On
+    // failure return 0 and set err.
+    static SharedSocket*
+    acquire(const SockAddr& local, const SockOpts& so, int& err);
+
+    void release();
+
+    int socket() const { return udp_sock; }
+
+    ErlDrvSSizeT
+    control(unsigned command, const char* buf, ErlDrvSizeT len,
+            char** rbuf, ErlDrvSizeT rlen);
+
+    void outputv(ErlIOVec& ev);
+
+    void stop();
+
+    void input_ready();
+
+    static void send_to(void* data, const byte* p, size_t len,
+                        const sockaddr* to, socklen_t slen);
+    static void send_error(void* data, int errcode);
+
+protected:
+    ErlDrvSSizeT close(const char* buf, ErlDrvSizeT len,
+                       char** rbuf, ErlDrvSizeT rlen);
+
+    ErlDrvSSizeT peername(const char* buf, ErlDrvSizeT len,
+                          char** rbuf, ErlDrvSizeT rlen);
+
+private:
+    SharedSocket(int sock, const SockOpts& so, const SockAddr& addr);
+    ~SharedSocket();
+
+    void do_send_to(const byte* p, size_t len, const sockaddr* to,
+                    socklen_t slen);
+
+    // local address and recv_batch
+    typedef std::pair<SockAddr, int> PoolKey;
+    typedef std::multimap<PoolKey, SharedSocket*> Pool;
+    static Pool pool;
+    static ErlDrvMutex* pool_mutex;
+
+    PoolKey key;
+    int users;
+
+    // prevent copies
+    SharedSocket(const SharedSocket&);
+    void operator=(const SharedSocket&);
+};
+
+}
+
+
+// this block comment is for emacs, do not delete
+// Local Variables:
+// mode: c++
+// c-file-style: "stroustrup"
+// c-file-offsets: ((innamespace . 0))
+// End:
+
+#endif
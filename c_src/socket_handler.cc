@@ -28,6 +28,8 @@
 #include "globals.h"
 #include "utils.h"
 #include "locker.h"
+#include "udp_batch.h"
+#include "engine.h"
 
 
 using namespace UtpDrv;
@@ -38,12 +40,17 @@ UtpDrv::SocketHandler::~SocketHandler()
 }
 
 UtpDrv::SocketHandler::SocketHandler() :
-    udp_sock(INVALID_SOCKET), close_pending(false), selected(false)
+    udp_sock(INVALID_SOCKET), engine(0), gso_usable(true), gro_reads(0),
+    gro_segments(0), gro_enabled(false), backlog_depth(0), backlog_drops(0),
+    recv_unacked(0), recv_paused(false), close_pending(false), selected(false)
 {
 }
 
-UtpDrv::SocketHandler::SocketHandler(int fd, const SockOpts& so) :
-    sockopts(so), udp_sock(fd), close_pending(false), selected(false)
+UtpDrv::SocketHandler::SocketHandler(int fd, const SockOpts& so,
+                                     Engine* eng) :
+    sockopts(so), udp_sock(fd), engine(eng), gso_usable(true), gro_reads(0),
+    gro_segments(0), gro_enabled(false), backlog_depth(0), backlog_drops(0),
+    recv_unacked(0), recv_paused(false), close_pending(false), selected(false)
 {
 }
 
@@ -150,6 +157,7 @@ UtpDrv::SocketHandler::setopts(const char* buf, ErlDrvSizeT len,
         return reinterpret_cast<ErlDrvSSizeT>(ERL_DRV_ERROR_BADARG);
     }
 
+    Engine::Lock lock(engine);
     Active saved_active = sockopts.active;
     SockOpts opts(sockopts);
     try {
@@ -157,9 +165,16 @@ UtpDrv::SocketHandler::setopts(const char* buf, ErlDrvSizeT len,
     } catch (const std::invalid_argument&) {
         return reinterpret_cast<ErlDrvSSizeT>(ERL_DRV_ERROR_BADARG);
     }
+    if (!opts_supported(opts)) {
+        return encode_error(rbuf, rlen, EINVAL);
+    }
     sockopts = opts;
-    bool send = false;
-    MutexLocker lock(utp_mutex);
+    if (sockopts.active == ACTIVE_N && sockopts.active_n <= 0) {
+        sockopts.active = ACTIVE_FALSE;
+        sockopts.active_n = 0;
+        emit_passive_message();
+    }
+    bool send = ack_delivered(0) && sockopts.active != ACTIVE_FALSE;
     switch (saved_active) {
     case ACTIVE_FALSE:
         switch (sockopts.active) {
@@ -171,17 +186,20 @@ UtpDrv::SocketHandler::setopts(const char* buf, ErlDrvSizeT len,
             }
             break;
         case ACTIVE_TRUE:
+        case ACTIVE_N:
             send = true;
             break;
         }
         break;
     case ACTIVE_ONCE:
     case ACTIVE_TRUE:
+    case ACTIVE_N:
         switch (sockopts.active) {
         case ACTIVE_FALSE:
         case ACTIVE_ONCE:
             break;
         case ACTIVE_TRUE:
+        case ACTIVE_N:
             send = true;
             break;
         }
@@ -233,6 +251,8 @@ UtpDrv::SocketHandler::getopts(const char* buf, ErlDrvSizeT len,
                     encoder.atom("false");
                 } else if (sockopts.active == ACTIVE_TRUE) {
                     encoder.atom("true");
+                } else if (sockopts.active == ACTIVE_N) {
+                    encoder.longval(sockopts.active_n);
                 } else {
                     encoder.atom("once");
                 }
@@ -255,7 +275,19 @@ UtpDrv::SocketHandler::getopts(const char* buf, ErlDrvSizeT len,
                 break;
             case UTP_PACKET_OPT:
                 encoder.tuple_header(2).atom("packet");
-                encoder.ulongval(sockopts.packet);
+                if (sockopts.packet == UTP_PACKET_LINE) {
+                    encoder.atom("line");
+                } else {
+                    encoder.ulongval(sockopts.packet);
+                }
+                break;
+            case UTP_PACKET_SIZE_OPT:
+                encoder.tuple_header(2).atom("packet_size");
+                encoder.ulongval(sockopts.packet_size);
+                break;
+            case UTP_LINE_DELIMITER_OPT:
+                encoder.tuple_header(2).atom("line_delimiter");
+                encoder.ulongval(sockopts.line_delimiter);
                 break;
             case UTP_SNDBUF_OPT:
                 encoder.tuple_header(2).atom("sndbuf");
@@ -265,6 +297,61 @@ UtpDrv::SocketHandler::getopts(const char* buf, ErlDrvSizeT len,
                 encoder.tuple_header(2).atom("recbuf");
                 encoder.ulongval(sockopts.recbuf);
                 break;
+            case UTP_RECV_BATCH_OPT:
+                encoder.tuple_header(2).atom("recv_batch");
+                encoder.ulongval(sockopts.recv_batch);
+                break;
+            case UTP_GSO_OPT:
+                encoder.tuple_header(2).atom("gso");
+                encoder.atom(sockopts.gso ? "true" : "false");
+                break;
+            case UTP_GRO_OPT:
+                encoder.tuple_header(2).atom("gro");
+                encoder.atom(sockopts.gro ? "true" : "false");
+                break;
+            case UTP_SHARED_SOCKET_OPT:
+                encoder.tuple_header(2).atom("shared_socket");
+                encoder.atom(sockopts.shared_socket ? "true" : "false");
+                break;
+            case UTP_BACKLOG_OPT:
+                encoder.tuple_header(2).atom("backlog");
+                encoder.ulongval(sockopts.backlog);
+                break;
+            case UTP_SHARDS_OPT:
+                encoder.tuple_header(2).atom("shards");
+                encoder.ulongval(sockopts.shards);
+                break;
+            case UTP_ACTIVE_BATCH_OPT:
+                encoder.tuple_header(2).atom("active_batch");
+                encoder.ulongval(sockopts.active_batch);
+                break;
+            case UTP_RECV_WATERMARK_OPT:
+                encoder.tuple_header(2).atom("recv_watermark");
+                encoder.tuple_header(2).ulongval(sockopts.recv_low);
+                encoder.ulongval(sockopts.recv_high);
+                break;
+            case UTP_ZEROCOPY_OPT:
+                encoder.tuple_header(2).atom("zerocopy");
+                encoder.atom(sockopts.zerocopy ? "true" : "false");
+                break;
+            case UTP_HIGH_WATERMARK_OPT:
+                encoder.tuple_header(2).atom("high_watermark");
+                encoder.ulongval(sockopts.high_watermark);
+                break;
+            case UTP_LOW_WATERMARK_OPT:
+                encoder.tuple_header(2).atom("low_watermark");
+                encoder.ulongval(sockopts.low_watermark);
+                break;
+            case UTP_BACKLOG_STATS_OPT:
+                encoder.tuple_header(2).atom("backlog_stats");
+                encoder.tuple_header(2).ulongval(backlog_depth);
+                encoder.ulongval(backlog_drops);
+                break;
+            case UTP_GRO_SEGMENTS_OPT:
+                encoder.tuple_header(2).atom("gro_segments");
+                encoder.tuple_header(2).ulongval(gro_reads);
+                encoder.ulongval(gro_segments);
+                break;
             default:
             {
                 EiEncoder error;
@@ -285,38 +372,65 @@ bool
 UtpDrv::SocketHandler::emit_read_buffer(ErlDrvSizeT len,
                                         const Receiver& receiver,
                                         ErlDrvSizeT& new_qsize)
+{
+    bool sent = emit_read_data(len, receiver, new_qsize);
+    // with packet framing each pass delivers a single packet, so keep going
+    // while the socket stays active and whole packets remain queued
+    while (sent && sockopts.packet != 0 && receiver.send_to_connected &&
+           (sockopts.active == ACTIVE_TRUE || sockopts.active == ACTIVE_N)) {
+        ErlDrvSizeT qsize;
+        if (!emit_read_data(0, receiver, qsize)) {
+            break;
+        }
+        new_qsize = qsize;
+    }
+    return sent;
+}
+
+bool
+UtpDrv::SocketHandler::emit_read_data(ErlDrvSizeT len,
+                                      const Receiver& receiver,
+                                      ErlDrvSizeT& new_qsize)
 {
     if (close_pending && emit_closed_message()) {
         close_pending = false;
         return false;
     }
-    new_qsize = driver_sizeq(port);
-    if (new_qsize == 0 || new_qsize < len || new_qsize < sockopts.packet) {
+    new_qsize = read_queue.size();
+    if (new_qsize == 0 || new_qsize < len) {
         return false;
     }
-    size_t pkts_to_send = 1;
-    uint32_t pkt_size = 0;
-    ustring buf;
-    int vlen;
-    SysIOVec* vec = driver_peekq(port, &vlen);
-    switch (sockopts.packet) {
-    case 1:
-        pkt_size = *reinterpret_cast<unsigned char*>(vec[0].iov_base);
-        break;
-    case 2:
-        pkt_size = ntohs(*reinterpret_cast<uint16_t*>(vec[0].iov_base));
-        break;
-    case 4:
-        pkt_size = ntohl(*reinterpret_cast<uint32_t*>(vec[0].iov_base));
-        break;
+    if (recv_paused && receiver.send_to_connected) {
+        return false;
     }
-    if (pkt_size != 0) {
-        if (new_qsize < (sockopts.packet + pkt_size)) {
+    size_t pkts_to_send = 1;
+    size_t pkt_size = 0;
+
+    // Each message is taken from the read queue as a binary and an offset
+    // into it. Usually the binary is one of the queue's slabs, in which case
+    // binary mode delivers a sub-binary of it without copying the data.
+    ErlDrvBinary* bin = 0;
+    size_t offset = 0;
+    if (sockopts.packet != 0) {
+        switch (parser.parse(read_queue, sockopts.packet,
+                             sockopts.packet_size, sockopts.line_delimiter)) {
+        case PacketParser::INCOMPLETE:
             return false;
+        case PacketParser::TOO_BIG:
+            emit_frame_error(receiver);
+            new_qsize = 0;
+            return true;
+        case PacketParser::COMPLETE:
+            break;
         }
-        driver_deq(port, sockopts.packet);
-        vec = driver_peekq(port, &vlen);
-        new_qsize = move_read_data(vec, vlen, buf, pkt_size);
+        if (sockopts.active_batch != 0 && sockopts.active != ACTIVE_FALSE &&
+            receiver.send_to_connected) {
+            return emit_packet_batch(new_qsize);
+        }
+        pkt_size = parser.frame_size();
+        read_queue.drop(parser.header_size());
+        bin = read_queue.take(pkt_size, offset);
+        parser.consumed();
         reduce_read_count(pkt_size);
     } else if (sockopts.active == ACTIVE_FALSE) {
         if (len == 0) {
@@ -326,41 +440,61 @@ UtpDrv::SocketHandler::emit_read_buffer(ErlDrvSizeT len,
             pkt_size = len;
             reduce_read_count(pkt_size);
         }
-        new_qsize = move_read_data(vec, vlen, buf, pkt_size);
+        bin = read_queue.take(pkt_size, offset);
     } else {
+        if (sockopts.active_batch != 0) {
+            batch_read_count(sockopts.active_batch);
+        }
         if (sockopts.active == ACTIVE_TRUE) {
             pkts_to_send = read_count.size();
+        } else if (sockopts.active == ACTIVE_N) {
+            pkts_to_send = read_count.size();
+            if (pkts_to_send > size_t(sockopts.active_n)) {
+                pkts_to_send = sockopts.active_n;
+            }
         }
     }
+    size_t pkts_sent = 0;
 
     while (pkts_to_send-- > 0) {
-        if (buf.size() == 0) {
+        if (bin == 0) {
+            if (recv_paused) {
+                break;
+            }
             pkt_size = read_count.front();
             read_count.pop_front();
-            new_qsize = move_read_data(vec, vlen, buf, pkt_size);
+            bin = read_queue.take(pkt_size, offset);
         }
+        new_qsize = read_queue.size();
+        const unsigned char* p =
+            reinterpret_cast<unsigned char*>(bin->orig_bytes) + offset;
+        // a frame shorter than the header option is all header
+        size_t hdr = size_t(sockopts.header) < pkt_size ?
+            sockopts.header : pkt_size;
         int index = 0;
-        ErlDrvTermData term[2*sockopts.header+14];
+        ErlDrvTermData term[2*sockopts.header+15];
         if (receiver.send_to_connected) {
             term[index++] = ERL_DRV_ATOM;
             term[index++] = driver_mk_atom(const_cast<char*>("utp"));
             term[index++] = ERL_DRV_PORT;
             term[index++] = driver_mk_port(port);
-            const unsigned char* p = buf.data();
-            for (int i = 0; i < sockopts.header; ++i, index += 2) {
+            for (size_t i = 0; i < hdr; ++i, index += 2) {
                 term[index] = ERL_DRV_UINT;
                 term[index+1] = *p++;
             }
             if (sockopts.delivery_mode == DATA_LIST) {
                 term[index++] = ERL_DRV_STRING;
+                term[index++] = reinterpret_cast<ErlDrvTermData>(p);
+                term[index++] = pkt_size - hdr;
             } else {
-                term[index++] = ERL_DRV_BUF2BINARY;
+                term[index++] = ERL_DRV_BINARY;
+                term[index++] = reinterpret_cast<ErlDrvTermData>(bin);
+                term[index++] = pkt_size - hdr;
+                term[index++] = offset + hdr;
             }
-            term[index++] = reinterpret_cast<ErlDrvTermData>(p);
-            term[index++] = pkt_size - sockopts.header;
-            if (sockopts.header != 0) {
+            if (hdr != 0) {
                 term[index++] = ERL_DRV_LIST;
-                term[index++] = sockopts.header + 1;
+                term[index++] = hdr + 1;
             }
             term[index++] = ERL_DRV_TUPLE;
             term[index++] = 3;
@@ -371,17 +505,17 @@ UtpDrv::SocketHandler::emit_read_buffer(ErlDrvSizeT len,
             term[index++] = receiver.caller_ref.size();
             term[index++] = ERL_DRV_ATOM;
             term[index++] = driver_mk_atom(const_cast<char*>("ok"));
-            const unsigned char* p = buf.data();
-            for (int i = 0; i < sockopts.header; ++i, index += 2) {
+            for (size_t i = 0; i < hdr; ++i, index += 2) {
                 term[index] = ERL_DRV_UINT;
                 term[index+1] = *p++;
             }
-            term[index++] = ERL_DRV_BUF2BINARY;
-            term[index++] = reinterpret_cast<ErlDrvTermData>(p);
-            term[index++] = pkt_size - sockopts.header;
-            if (sockopts.header != 0) {
+            term[index++] = ERL_DRV_BINARY;
+            term[index++] = reinterpret_cast<ErlDrvTermData>(bin);
+            term[index++] = pkt_size - hdr;
+            term[index++] = offset + hdr;
+            if (hdr != 0) {
                 term[index++] = ERL_DRV_LIST;
-                term[index++] = sockopts.header + 1;
+                term[index++] = hdr + 1;
             }
             term[index++] = ERL_DRV_TUPLE;
             term[index++] = 2;
@@ -389,15 +523,154 @@ UtpDrv::SocketHandler::emit_read_buffer(ErlDrvSizeT len,
             term[index++] = 2;
             driver_send_term(port, receiver.caller, term, index);
         }
-        if (pkts_to_send != 0) {
-            buf.clear();
-            vec = driver_peekq(port, &vlen);
+        driver_free_binary(bin);
+        bin = 0;
+        ++pkts_sent;
+        if (receiver.send_to_connected) {
+            count_unacked(pkt_size);
+        }
+    }
+    count_delivered(pkts_sent);
+    return true;
+}
+
+bool
+UtpDrv::SocketHandler::emit_packet_batch(ErlDrvSizeT& new_qsize)
+{
+    // Send {utp_batch, Port, Msgs} holding as many whole packets as fit in
+    // active_batch bytes, always at least one
+    std::vector<ErlDrvTermData> term;
+    std::vector<ErlDrvBinary*> bins;
+    term.push_back(ERL_DRV_ATOM);
+    term.push_back(driver_mk_atom(const_cast<char*>("utp_batch")));
+    term.push_back(ERL_DRV_PORT);
+    term.push_back(driver_mk_port(port));
+    size_t bytes = 0;
+    while (parser.parse(read_queue, sockopts.packet, sockopts.packet_size,
+                        sockopts.line_delimiter) == PacketParser::COMPLETE) {
+        size_t pkt_size = parser.frame_size();
+        if (!bins.empty() && (bytes + pkt_size > sockopts.active_batch ||
+                              (sockopts.recv_high != 0 &&
+                               recv_unacked + bytes + pkt_size >
+                               sockopts.recv_high))) {
+            break;
+        }
+        size_t offset;
+        read_queue.drop(parser.header_size());
+        ErlDrvBinary* bin = read_queue.take(pkt_size, offset);
+        parser.consumed();
+        reduce_read_count(pkt_size);
+        bins.push_back(bin);
+        bytes += pkt_size;
+        const unsigned char* p =
+            reinterpret_cast<unsigned char*>(bin->orig_bytes) + offset;
+        size_t hdr = size_t(sockopts.header) < pkt_size ?
+            sockopts.header : pkt_size;
+        for (size_t i = 0; i < hdr; ++i) {
+            term.push_back(ERL_DRV_UINT);
+            term.push_back(*p++);
+        }
+        if (sockopts.delivery_mode == DATA_LIST) {
+            term.push_back(ERL_DRV_STRING);
+            term.push_back(reinterpret_cast<ErlDrvTermData>(p));
+            term.push_back(pkt_size - hdr);
+        } else {
+            term.push_back(ERL_DRV_BINARY);
+            term.push_back(reinterpret_cast<ErlDrvTermData>(bin));
+            term.push_back(pkt_size - hdr);
+            term.push_back(offset + hdr);
+        }
+        if (hdr != 0) {
+            term.push_back(ERL_DRV_LIST);
+            term.push_back(hdr + 1);
         }
     }
+    new_qsize = read_queue.size();
+    if (bins.empty()) {
+        return false;
+    }
+    term.push_back(ERL_DRV_NIL);
+    term.push_back(ERL_DRV_LIST);
+    term.push_back(bins.size() + 1);
+    term.push_back(ERL_DRV_TUPLE);
+    term.push_back(3);
+    driver_output_term(port, &term[0], term.size());
+    for (size_t i = 0; i < bins.size(); ++i) {
+        driver_free_binary(bins[i]);
+    }
+    count_delivered(1);
+    count_unacked(bytes);
+    return true;
+}
+
+void
+UtpDrv::SocketHandler::emit_frame_error(const Receiver& receiver)
+{
+    // A frame over packet_size leaves no way to find the next one, so
+    // report emsgsize, discard what is queued and give up on the connection
+    ErlDrvTermData error = driver_mk_atom(erl_errno_id(EMSGSIZE));
+    if (receiver.send_to_connected) {
+        ErlDrvTermData term[] = {
+            ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("utp_error")),
+            ERL_DRV_PORT, driver_mk_port(port),
+            ERL_DRV_ATOM, error,
+            ERL_DRV_TUPLE, 3,
+        };
+        driver_output_term(port, term, sizeof term/sizeof *term);
+    } else {
+        ErlDrvTermData term[] = {
+            ERL_DRV_EXT2TERM, receiver.caller_ref, receiver.caller_ref.size(),
+            ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("error")),
+            ERL_DRV_ATOM, error,
+            ERL_DRV_TUPLE, 2,
+            ERL_DRV_TUPLE, 2,
+        };
+        driver_send_term(port, receiver.caller, term,
+                         sizeof term/sizeof *term);
+    }
+    read_queue.clear();
+    read_count.clear();
+    abort_read();
+}
+
+void
+UtpDrv::SocketHandler::count_unacked(size_t bytes)
+{
+    if (sockopts.recv_high != 0) {
+        recv_unacked += bytes;
+        if (recv_unacked >= sockopts.recv_high) {
+            recv_paused = true;
+        }
+    }
+}
+
+bool
+UtpDrv::SocketHandler::ack_delivered(size_t bytes)
+{
+    recv_unacked = bytes < recv_unacked ? recv_unacked - bytes : 0;
+    if (sockopts.recv_high == 0) {
+        recv_unacked = 0;
+    }
+    if (recv_paused && recv_unacked <= sockopts.recv_low) {
+        recv_paused = false;
+        return true;
+    }
+    return false;
+}
+
+void
+UtpDrv::SocketHandler::count_delivered(size_t msgs)
+{
     if (sockopts.active == ACTIVE_ONCE) {
         sockopts.active = ACTIVE_FALSE;
+    } else if (sockopts.active == ACTIVE_N) {
+        sockopts.active_n -= msgs;
+        if (sockopts.active_n <= 0) {
+            sockopts.active = ACTIVE_FALSE;
+            sockopts.active_n = 0;
+            emit_passive_message();
+        }
     }
-    return true;
 }
 
 void
@@ -413,33 +686,31 @@ UtpDrv::SocketHandler::reduce_read_count(size_t reduction)
     }
 }
 
-size_t
-UtpDrv::SocketHandler::move_read_data(const SysIOVec* vec, int vlen,
-                                      ustring& buf, size_t pkt_size)
+void
+UtpDrv::SocketHandler::batch_read_count(size_t limit)
 {
-    size_t total = 0;
-    buf.reserve(pkt_size);
-    for (int i = 0; i < vlen; ++i) {
-        size_t needed = pkt_size - total;
-        bool stop = true;
-        if (needed > vec[i].iov_len) {
-            needed = vec[i].iov_len;
-            stop = false;
-        }
-        buf.append(reinterpret_cast<unsigned char*>(vec[i].iov_base), needed);
-        total += needed;
-        if (stop) {
-            break;
+    // merge consecutive reads into chunks of at most limit bytes, so that
+    // each chunk goes out as a single message
+    ReadCount batched;
+    size_t sum = 0;
+    ReadCount::const_iterator it = read_count.begin();
+    for (; it != read_count.end(); ++it) {
+        if (sum != 0 && sum + *it > limit) {
+            batched.push_back(sum);
+            sum = 0;
         }
+        sum += *it;
     }
-    driver_deq(port, pkt_size);
-    return driver_sizeq(port);
+    if (sum != 0) {
+        batched.push_back(sum);
+    }
+    read_count.swap(batched);
 }
 
 bool
 UtpDrv::SocketHandler::emit_closed_message()
 {
-    ErlDrvSizeT qsize = driver_sizeq(port);
+    ErlDrvSizeT qsize = read_queue.size();
     if (qsize == 0) {
         ErlDrvTermData term[] = {
             ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("utp_closed")),
@@ -451,10 +722,28 @@ UtpDrv::SocketHandler::emit_closed_message()
     return qsize == 0;
 }
 
+void
+UtpDrv::SocketHandler::emit_passive_message()
+{
+    ErlDrvTermData term[] = {
+        ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("utp_passive")),
+        ERL_DRV_PORT, driver_mk_port(port),
+        ERL_DRV_TUPLE, 2,
+    };
+    driver_output_term(port, term, sizeof term/sizeof *term);
+}
+
 UtpDrv::SocketHandler::SockOpts::SockOpts() :
-    send_tmout(-1), active(ACTIVE_TRUE), fd(-1), header(0),
-    sndbuf(UTP_SNDBUF_DEFAULT), recbuf(UTP_RECBUF_DEFAULT), port(0),
-    delivery_mode(DATA_LIST), packet(0), inet6(false), addr_set(false)
+    send_tmout(-1), active(ACTIVE_TRUE), active_n(0), fd(-1), header(0),
+    sndbuf(UTP_SNDBUF_DEFAULT), recbuf(UTP_RECBUF_DEFAULT),
+    recv_batch(UTP_RECV_BATCH_DEFAULT), backlog(UTP_BACKLOG_DEFAULT),
+    shards(1), active_batch(0), recv_low(0), recv_high(0),
+    high_watermark(UTP_HIGH_WATERMARK_DEFAULT),
+    low_watermark(UTP_LOW_WATERMARK_DEFAULT), packet_size(0), port(0),
+    delivery_mode(DATA_LIST), packet(0),
+    line_delimiter(UTP_LINE_DELIMITER_DEFAULT), inet6(false), gso(false),
+    gro(false), shared_socket(false), zerocopy(false),
+    addr_set(false)
 {
 }
 
@@ -519,6 +808,11 @@ UtpDrv::SocketHandler::SockOpts::decode(const Binary& bin, OptsList* opts_list)
             break;
         case UTP_ACTIVE_OPT:
             active = static_cast<Active>(*data++);
+            if (active == ACTIVE_N) {
+                active_n = static_cast<int16_t>(
+                    ntohs(*reinterpret_cast<const uint16_t*>(data)));
+                data += 2;
+            }
             if (opts_list != 0) {
                 opts_list->push_back(UTP_ACTIVE_OPT);
             }
@@ -550,6 +844,102 @@ UtpDrv::SocketHandler::SockOpts::decode(const Binary& bin, OptsList* opts_list)
                 opts_list->push_back(UTP_RECBUF_OPT);
             }
             break;
+        case UTP_RECV_BATCH_OPT:
+            recv_batch = ntohs(*reinterpret_cast<const uint16_t*>(data));
+            data += 2;
+            if (recv_batch > UTP_RECV_BATCH_MAX) {
+                recv_batch = UTP_RECV_BATCH_MAX;
+            }
+            if (opts_list != 0) {
+                opts_list->push_back(UTP_RECV_BATCH_OPT);
+            }
+            break;
+        case UTP_GSO_OPT:
+            gso = (*data++ != 0);
+            if (opts_list != 0) {
+                opts_list->push_back(UTP_GSO_OPT);
+            }
+            break;
+        case UTP_GRO_OPT:
+            gro = (*data++ != 0);
+            if (opts_list != 0) {
+                opts_list->push_back(UTP_GRO_OPT);
+            }
+            break;
+        case UTP_SHARED_SOCKET_OPT:
+            shared_socket = (*data++ != 0);
+            if (opts_list != 0) {
+                opts_list->push_back(UTP_SHARED_SOCKET_OPT);
+            }
+            break;
+        case UTP_BACKLOG_OPT:
+            backlog = ntohs(*reinterpret_cast<const uint16_t*>(data));
+            data += 2;
+            if (opts_list != 0) {
+                opts_list->push_back(UTP_BACKLOG_OPT);
+            }
+            break;
+        case UTP_SHARDS_OPT:
+            shards = *data++;
+            if (opts_list != 0) {
+                opts_list->push_back(UTP_SHARDS_OPT);
+            }
+            break;
+        case UTP_ACTIVE_BATCH_OPT:
+            active_batch = ntohl(*reinterpret_cast<const uint32_t*>(data));
+            data += 4;
+            if (opts_list != 0) {
+                opts_list->push_back(UTP_ACTIVE_BATCH_OPT);
+            }
+            break;
+        case UTP_RECV_WATERMARK_OPT:
+            recv_low = ntohl(*reinterpret_cast<const uint32_t*>(data));
+            data += 4;
+            recv_high = ntohl(*reinterpret_cast<const uint32_t*>(data));
+            data += 4;
+            if (opts_list != 0) {
+                opts_list->push_back(UTP_RECV_WATERMARK_OPT);
+            }
+            break;
+        case UTP_HIGH_WATERMARK_OPT:
+            high_watermark = ntohl(*reinterpret_cast<const uint32_t*>(data));
+            data += 4;
+            if (low_watermark > high_watermark) {
+                low_watermark = high_watermark;
+            }
+            if (opts_list != 0) {
+                opts_list->push_back(UTP_HIGH_WATERMARK_OPT);
+            }
+            break;
+        case UTP_LOW_WATERMARK_OPT:
+            low_watermark = ntohl(*reinterpret_cast<const uint32_t*>(data));
+            data += 4;
+            if (high_watermark < low_watermark) {
+                high_watermark = low_watermark;
+            }
+            if (opts_list != 0) {
+                opts_list->push_back(UTP_LOW_WATERMARK_OPT);
+            }
+            break;
+        case UTP_ZEROCOPY_OPT:
+            zerocopy = (*data++ != 0);
+            if (opts_list != 0) {
+                opts_list->push_back(UTP_ZEROCOPY_OPT);
+            }
+            break;
+        case UTP_PACKET_SIZE_OPT:
+            packet_size = ntohl(*reinterpret_cast<const uint32_t*>(data));
+            data += 4;
+            if (opts_list != 0) {
+                opts_list->push_back(UTP_PACKET_SIZE_OPT);
+            }
+            break;
+        case UTP_LINE_DELIMITER_OPT:
+            line_delimiter = static_cast<unsigned char>(*data++);
+            if (opts_list != 0) {
+                opts_list->push_back(UTP_LINE_DELIMITER_OPT);
+            }
+            break;
         }
     }
     if (addr_set) {
@@ -588,7 +978,17 @@ UtpDrv::SocketHandler::SockOpts::decode_and_merge(const Binary& bin)
             send_tmout = so.send_tmout;
             break;
         case UTP_ACTIVE_OPT:
-            active = so.active;
+            // like gen_tcp, {active, N} on a socket already in that mode
+            // adds to the remaining count
+            if (active == ACTIVE_N && so.active == ACTIVE_N) {
+                active_n += so.active_n;
+                if (active_n > 32767) {
+                    active_n = 32767;
+                }
+            } else {
+                active = so.active;
+                active_n = so.active_n;
+            }
             break;
         case UTP_PACKET_OPT:
             packet = so.packet;
@@ -602,6 +1002,58 @@ UtpDrv::SocketHandler::SockOpts::decode_and_merge(const Binary& bin)
         case UTP_RECBUF_OPT:
             recbuf = so.recbuf;
             break;
+        case UTP_RECV_BATCH_OPT:
+            recv_batch = so.recv_batch;
+            break;
+        case UTP_GSO_OPT:
+            gso = so.gso;
+            break;
+        case UTP_GRO_OPT:
+            gro = so.gro;
+            break;
+        case UTP_GRO_SEGMENTS_OPT:
+            throw std::invalid_argument("gro_segments");
+            break;
+        case UTP_SHARED_SOCKET_OPT:
+            throw std::invalid_argument("shared_socket");
+            break;
+        case UTP_BACKLOG_OPT:
+            backlog = so.backlog;
+            break;
+        case UTP_BACKLOG_STATS_OPT:
+            throw std::invalid_argument("backlog_stats");
+            break;
+        case UTP_SHARDS_OPT:
+            throw std::invalid_argument("shards");
+            break;
+        case UTP_ACTIVE_BATCH_OPT:
+            active_batch = so.active_batch;
+            break;
+        case UTP_RECV_WATERMARK_OPT:
+            recv_low = so.recv_low;
+            recv_high = so.recv_high;
+            break;
+        case UTP_HIGH_WATERMARK_OPT:
+            high_watermark = so.high_watermark;
+            if (low_watermark > high_watermark) {
+                low_watermark = high_watermark;
+            }
+            break;
+        case UTP_LOW_WATERMARK_OPT:
+            low_watermark = so.low_watermark;
+            if (high_watermark < low_watermark) {
+                high_watermark = low_watermark;
+            }
+            break;
+        case UTP_ZEROCOPY_OPT:
+            zerocopy = so.zerocopy;
+            break;
+        case UTP_PACKET_SIZE_OPT:
+            packet_size = so.packet_size;
+            break;
+        case UTP_LINE_DELIMITER_OPT:
+            line_delimiter = so.line_delimiter;
+            break;
         }
     }
 }
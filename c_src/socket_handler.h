@@ -28,10 +28,14 @@
 #include <string>
 #include "handler.h"
 #include "drv_types.h"
+#include "read_queue.h"
+#include "packet_parser.h"
 
 
 namespace UtpDrv {
 
+class Engine;
+
 struct BadSockAddr : public std::exception {};
 struct SocketFailure : public std::exception
 {
@@ -61,6 +65,9 @@ struct SockAddr {
 
 const int UTP_SNDBUF_DEFAULT = 16384;
 const int UTP_RECBUF_DEFAULT = 16384;
+const int UTP_BACKLOG_DEFAULT = 5;
+const unsigned long UTP_HIGH_WATERMARK_DEFAULT = 65536;
+const unsigned long UTP_LOW_WATERMARK_DEFAULT = 32768;
 
 class SocketHandler : public Handler
 {
@@ -82,14 +89,30 @@ public:
         UTP_PACKET_OPT,
         UTP_HEADER_OPT,
         UTP_SNDBUF_OPT,
-        UTP_RECBUF_OPT
+        UTP_RECBUF_OPT,
+        UTP_RECV_BATCH_OPT,
+        UTP_GSO_OPT,
+        UTP_GRO_OPT,
+        UTP_GRO_SEGMENTS_OPT,
+        UTP_SHARED_SOCKET_OPT,
+        UTP_BACKLOG_OPT,
+        UTP_BACKLOG_STATS_OPT,
+        UTP_SHARDS_OPT,
+        UTP_ACTIVE_BATCH_OPT,
+        UTP_RECV_WATERMARK_OPT,
+        UTP_HIGH_WATERMARK_OPT,
+        UTP_LOW_WATERMARK_OPT,
+        UTP_ZEROCOPY_OPT,
+        UTP_PACKET_SIZE_OPT,
+        UTP_LINE_DELIMITER_OPT
     };
     typedef std::vector<Opts> OptsList;
 
     enum Active {
         ACTIVE_FALSE,
         ACTIVE_ONCE,
-        ACTIVE_TRUE
+        ACTIVE_TRUE,
+        ACTIVE_N
     };
 
     struct SockOpts {
@@ -102,13 +125,38 @@ public:
         char addrstr[INET6_ADDRSTRLEN];
         long send_tmout;
         Active active;
+        // for ACTIVE_N, the number of messages left to deliver before the
+        // socket turns passive
+        int active_n;
         int fd;
         int header;
         int sndbuf, recbuf;
+        int recv_batch;
+        int backlog;
+        int shards;
+        // in active mode, the most bytes coalesced into one message, or 0
+        // to deliver each read separately
+        unsigned long active_batch;
+        // in active mode, delivery pauses once recv_high bytes delivered
+        // to the owner await its acknowledgement, and resumes when that
+        // falls to recv_low; a recv_high of 0 turns this off
+        unsigned long recv_low, recv_high;
+        // senders block once the write queue holds high_watermark bytes,
+        // until it drains to low_watermark
+        unsigned long high_watermark, low_watermark;
+        // longest frame accepted with packet framing, or 0 for no limit
+        unsigned long packet_size;
         unsigned short port;
         DeliveryMode delivery_mode;
         unsigned char packet;
+        // byte ending each frame for {packet, line}
+        unsigned char line_delimiter;
         bool inet6;
+        bool gso;
+        bool gro;
+        bool shared_socket;
+        // send large datagrams with MSG_ZEROCOPY
+        bool zerocopy;
         bool addr_set;
     };
 
@@ -129,9 +177,11 @@ public:
 
     virtual void input_ready() = 0;
 
+    Engine* utp_engine() const { return engine; }
+
 protected:
     SocketHandler();
-    SocketHandler(int fd, const SockOpts& so);
+    SocketHandler(int fd, const SockOpts& so, Engine* eng);
 
     virtual ErlDrvSSizeT
     close(const char* buf, ErlDrvSizeT len, char** rbuf, ErlDrvSizeT rlen) = 0;
@@ -164,18 +214,75 @@ protected:
     emit_read_buffer(ErlDrvSizeT len, const Receiver& receiver,
                      ErlDrvSizeT& new_queue_size);
 
+    bool
+    emit_read_data(ErlDrvSizeT len, const Receiver& receiver,
+                   ErlDrvSizeT& new_queue_size);
+
+    bool emit_packet_batch(ErlDrvSizeT& new_queue_size);
+
+    void emit_frame_error(const Receiver& receiver);
+
+    // Give up on a connection whose framing has failed
+    virtual void abort_read() {}
+
+    // Return false if setopts would leave options this handler cannot
+    // honor, in which case they are refused with einval
+    virtual bool opts_supported(const SockOpts&) const { return true; }
+
+    void count_delivered(size_t msgs);
+
+    void count_unacked(size_t bytes);
+
+    // Record that the owner has consumed bytes of delivered data, and
+    // return true if that resumes paused delivery
+    bool ack_delivered(size_t bytes);
+
     void reduce_read_count(size_t reduction);
 
-    size_t
-    move_read_data(const SysIOVec* vec, int vlen, ustring& buf, size_t sz);
+    void batch_read_count(size_t limit);
 
     bool
     emit_closed_message();
 
+    void emit_passive_message();
+
+    // received data not yet delivered, and the sizes of the reads that
+    // brought it in
+    ReadQueue read_queue;
+    PacketParser parser;
     typedef std::list<size_t> ReadCount;
     ReadCount read_count;
     SockOpts sockopts;
     int udp_sock;
+
+    // the libutp engine this handler and its uTP sockets belong to
+    Engine* engine;
+
+    // Return the flag to pass to SendBatch::push for datagrams this
+    // handler sends, or null if they should not use GSO
+    bool* gso_flag() {
+        return sockopts.gso && gso_usable ? &gso_usable : 0;
+    }
+
+    // cleared by the engine's SendBatch, with its lock held, once the
+    // kernel refuses a GSO send from this handler
+    bool gso_usable;
+
+    // UDP_GRO state of udp_sock, and the number of coalesced reads and of
+    // the packets they carried, reported by the gro_segments option
+    unsigned long gro_reads, gro_segments;
+    bool gro_enabled;
+
+    // depth of a Listener's accept backlog and the number of connection
+    // attempts dropped because it was full, reported by backlog_stats
+    unsigned long backlog_depth, backlog_drops;
+
+    // bytes delivered in active mode that the owner has not yet
+    // acknowledged with recv_ack, and whether that has reached the high
+    // watermark
+    unsigned long recv_unacked;
+    bool recv_paused;
+
     bool close_pending, selected;
 };
 
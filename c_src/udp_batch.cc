@@ -0,0 +1,632 @@
+// -------------------------------------------------------------------
+//
+// udp_batch.cc: batched UDP datagram I/O
+//
+// Copyright (c) 2012-2013 Basho Technologies, Inc. All Rights Reserved.
+//
+// This file is provided to you under the Apache License,
+// Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License.  You may obtain
+// a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+//
+// -------------------------------------------------------------------
+
+#include <sys/socket.h>
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+#include <poll.h>
+#endif
+#include "udp_batch.h"
+#include "globals.h"
+
+
+#if defined(__linux__) && !defined(UDP_SEGMENT)
+#define UDP_SEGMENT 103
+#endif
+#if defined(__linux__) && !defined(UDP_GRO)
+#define UDP_GRO 104
+#endif
+#if defined(__linux__) && !defined(SO_ZEROCOPY)
+#define SO_ZEROCOPY 60
+#endif
+#if defined(__linux__) && !defined(MSG_ZEROCOPY)
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#if defined(__linux__) && !defined(SO_EE_ORIGIN_ZEROCOPY)
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+using namespace UtpDrv;
+
+UtpDrv::RecvBatch UtpDrv::recv_batch;
+
+UtpDrv::RecvBatch::RecvBatch() : bufs(0), slot(UTP_DGRAM_SIZE), emptied(true)
+{
+}
+
+UtpDrv::RecvBatch::~RecvBatch()
+{
+    if (bufs != 0) {
+        driver_free(bufs);
+    }
+}
+
+int
+UtpDrv::RecvBatch::recv(int sock, int count, bool gro)
+{
+    if (bufs == 0) {
+        void* p = driver_alloc(UTP_RECV_BATCH_MAX*UTP_DGRAM_SIZE);
+        if (p == 0) {
+            return 0;
+        }
+        bufs = static_cast<byte*>(p);
+    }
+    int max = UTP_RECV_BATCH_MAX;
+    slot = UTP_DGRAM_SIZE;
+#if defined(__linux__)
+    if (gro) {
+        max = UTP_GRO_BATCH_MAX;
+        slot = UTP_GRO_DGRAM_SIZE;
+    }
+#endif
+    if (count > max) {
+        count = max;
+    } else if (count < 1) {
+        count = 1;
+    }
+#if defined(__linux__)
+    union Control {
+        char buf[CMSG_SPACE(sizeof(int))];
+        cmsghdr align;
+    };
+    mmsghdr msgs[UTP_RECV_BATCH_MAX];
+    iovec iovs[UTP_RECV_BATCH_MAX];
+    Control ctrls[UTP_GRO_BATCH_MAX];
+    memset(msgs, 0, count*sizeof *msgs);
+    for (int i = 0; i < count; ++i) {
+        iovs[i].iov_base = bufs + i*slot;
+        iovs[i].iov_len = slot;
+        addrs[i].slen = sizeof addrs[i].addr;
+        msgs[i].msg_hdr.msg_name = &addrs[i].addr;
+        msgs[i].msg_hdr.msg_namelen = addrs[i].slen;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (gro) {
+            msgs[i].msg_hdr.msg_control = ctrls[i].buf;
+            msgs[i].msg_hdr.msg_controllen = sizeof ctrls[i].buf;
+        }
+    }
+    int got;
+    do {
+        got = recvmmsg(sock, msgs, count, MSG_DONTWAIT, 0);
+    } while (got < 0 && errno == EINTR);
+    emptied = got < count;
+    int nread = 0;
+    for (int i = 0; i < got; ++i) {
+        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            // the rest of the datagram is lost, so passing it on would
+            // only hand libutp a corrupt packet
+            UTPDRV_TRACER << "RecvBatch::recv: dropping truncated datagram on "
+                          << sock << UTPDRV_TRACE_ENDL;
+            continue;
+        }
+        // keep the datagrams read so far contiguous in the metadata; their
+        // data stays in its slot
+        if (nread != i) {
+            addrs[nread] = addrs[i];
+        }
+        offs[nread] = i*slot;
+        addrs[nread].slen = msgs[i].msg_hdr.msg_namelen;
+        lens[nread] = segs[nread] = msgs[i].msg_len;
+        if (gro) {
+            msghdr& hdr = msgs[i].msg_hdr;
+            for (cmsghdr* cm = CMSG_FIRSTHDR(&hdr); cm != 0;
+                 cm = CMSG_NXTHDR(&hdr, cm)) {
+                if (cm->cmsg_level == IPPROTO_UDP &&
+                    cm->cmsg_type == UDP_GRO) {
+                    int segsize;
+                    memcpy(&segsize, CMSG_DATA(cm), sizeof segsize);
+                    if (segsize > 0) {
+                        segs[nread] = segsize;
+                    }
+                }
+            }
+        }
+        ++nread;
+    }
+#else
+    int nread = 0;
+    while (nread < count) {
+        SockAddr& from = addrs[nread];
+        from.slen = sizeof from.addr;
+        ssize_t len = recvfrom(sock, bufs + nread*slot,
+                               slot, 0, from, &from.slen);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        offs[nread] = nread*slot;
+        lens[nread] = segs[nread] = len;
+        ++nread;
+    }
+    emptied = nread < count;
+#endif
+    UTPDRV_TRACER << "RecvBatch::recv: read " << nread << " datagrams from "
+                  << sock << UTPDRV_TRACE_ENDL;
+    return nread < 0 ? 0 : nread;
+}
+
+bool
+UtpDrv::set_udp_gro(int sock, bool on)
+{
+#if defined(__linux__)
+    int val = on;
+    return setsockopt(sock, IPPROTO_UDP, UDP_GRO, &val, sizeof val) == 0;
+#else
+    return !on;
+#endif
+}
+
+UtpDrv::ZeroCopy::ZeroCopy() :
+    first_id(0), sock(-1), on(false), copied(false)
+{
+}
+
+UtpDrv::ZeroCopy::~ZeroCopy()
+{
+    // Sends still outstanding were given up on by drain, or the socket
+    // went away without it. The kernel may still read their pages, so
+    // their binaries are deliberately never freed.
+    if (!sends.empty()) {
+        UTPDRV_TRACER << "ZeroCopy::~ZeroCopy: leaking " << sends.size()
+                      << " unfinished sends on " << sock << UTPDRV_TRACE_ENDL;
+    }
+}
+
+void
+UtpDrv::ZeroCopy::drain()
+{
+#if defined(__linux__)
+    reap();
+    for (int ms = 0; !sends.empty() && ms < UTP_ZEROCOPY_DRAIN_MS; ++ms) {
+        // POLLERR is reported whether or not it is asked for
+        pollfd pfd;
+        pfd.fd = sock;
+        pfd.events = 0;
+        pfd.revents = 0;
+        poll(&pfd, 1, 1);
+        reap();
+    }
+#endif
+}
+
+bool
+UtpDrv::ZeroCopy::enable(int s, bool enable)
+{
+#if defined(__linux__)
+    int val = enable;
+    if (setsockopt(s, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof val) != 0) {
+        return !enable;
+    }
+    sock = s;
+    on = enable;
+    return true;
+#else
+    return !enable;
+#endif
+}
+
+void
+UtpDrv::ZeroCopy::sent(ErlDrvBinary* header, ErlDrvBinary* const* bins,
+                       int count)
+{
+    sends.push_back(Send());
+    Send& send = sends.back();
+    send.done = false;
+    send.bins.reserve(count+1);
+    driver_binary_inc_refc(header);
+    send.bins.push_back(header);
+    for (int i = 0; i < count; ++i) {
+        driver_binary_inc_refc(bins[i]);
+        send.bins.push_back(bins[i]);
+    }
+    if (sends.size() >= UTP_ZEROCOPY_MAX_PENDING) {
+        reap();
+    }
+}
+
+void
+UtpDrv::ZeroCopy::reap()
+{
+#if defined(__linux__)
+    while (!sends.empty()) {
+        union Control {
+            char buf[CMSG_SPACE(sizeof(sock_extended_err)) +
+                     CMSG_SPACE(sizeof(sockaddr_storage))];
+            cmsghdr align;
+        } ctrl;
+        msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof ctrl.buf;
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != 0;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 &&
+                   cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cm), sizeof err);
+            if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                UTPDRV_TRACER << "ZeroCopy::reap: kernel copied sends on "
+                              << sock << ", stopping zero-copy"
+                              << UTPDRV_TRACE_ENDL;
+                copied = true;
+            }
+            complete(err.ee_info, err.ee_data);
+        }
+    }
+#endif
+}
+
+void
+UtpDrv::ZeroCopy::complete(uint32_t lo, uint32_t hi)
+{
+    // the range is inclusive, and the kernel's counter may wrap
+    uint32_t id = lo;
+    for (uint32_t n = hi - lo + 1; n > 0; --n, ++id) {
+        uint32_t i = id - first_id;
+        if (i < sends.size() && !sends[i].done) {
+            std::vector<ErlDrvBinary*>& bins = sends[i].bins;
+            for (size_t j = 0; j < bins.size(); ++j) {
+                driver_free_binary(bins[j]);
+            }
+            bins.clear();
+            sends[i].done = true;
+        }
+    }
+    while (!sends.empty() && sends.front().done) {
+        sends.pop_front();
+        ++first_id;
+    }
+}
+
+UtpDrv::SendBatch::SendBatch() :
+    buf(0), used(0), count(0), depth(0), niovs(0), nrefs(0)
+{
+}
+
+UtpDrv::SendBatch::~SendBatch()
+{
+    if (buf != 0) {
+        driver_free(buf);
+    }
+}
+
+void
+UtpDrv::SendBatch::push(int sock, const byte* p, size_t len,
+                        const UTPSlice* slices, size_t nslices,
+                        const sockaddr* to, socklen_t slen, bool* gso,
+                        UTPOnErrorProc* on_error, void* data, ZeroCopy* zc)
+{
+    if (nslices > UTP_MAX_SLICES) {
+        nslices = UTP_MAX_SLICES;
+    }
+    if (depth == 0 || len > UTP_SEND_BATCH_BYTES ||
+        (buf == 0 && (buf = static_cast<byte*>(
+                          driver_alloc(UTP_SEND_BATCH_BYTES))) == 0)) {
+        iovec iov[UTP_MAX_SLICES+1];
+        iov[0].iov_base = const_cast<byte*>(p);
+        iov[0].iov_len = len;
+        for (size_t i = 0; i < nslices; ++i) {
+            iov[i+1].iov_base = const_cast<byte*>(slices[i].bytes);
+            iov[i+1].iov_len = slices[i].len;
+        }
+        send_one(sock, iov, nslices+1, to, slen, on_error, data);
+        return;
+    }
+    if (count == UTP_SEND_BATCH_MAX || used + len > UTP_SEND_BATCH_BYTES) {
+        flush();
+    }
+    Datagram& dg = dgrams[count++];
+    memcpy(buf+used, p, len);
+    dg.iov = niovs;
+    dg.iovcnt = nslices+1;
+    iovs[niovs].iov_base = buf+used;
+    iovs[niovs++].iov_len = len;
+    dg.len = len;
+    dg.ref = nrefs;
+    dg.refcnt = nslices;
+    for (size_t i = 0; i < nslices; ++i) {
+        ErlDrvBinary* bin = static_cast<ErlDrvBinary*>(slices[i].token);
+        driver_binary_inc_refc(bin);
+        refs[nrefs++] = bin;
+        iovs[niovs].iov_base = const_cast<byte*>(slices[i].bytes);
+        iovs[niovs++].iov_len = slices[i].len;
+        dg.len += slices[i].len;
+    }
+    dg.sock = sock;
+    dg.on_error = on_error;
+    dg.data = data;
+    dg.zc = zc;
+    dg.gso = gso;
+    dg.has_to = (to != 0);
+    if (dg.has_to) {
+        memcpy(&dg.addr.addr, to, slen);
+        dg.addr.slen = slen;
+    }
+    used += len;
+}
+
+void
+UtpDrv::SendBatch::flush()
+{
+    int first = 0;
+    while (first < count) {
+        int last = first + 1;
+        while (last < count && dgrams[last].sock == dgrams[first].sock) {
+            ++last;
+        }
+        send_run(first, last);
+        first = last;
+    }
+    for (int i = 0; i < nrefs; ++i) {
+        driver_free_binary(refs[i]);
+    }
+    count = niovs = nrefs = 0;
+    used = 0;
+}
+
+void
+UtpDrv::SendBatch::send_one(int sock, const iovec* iov, int iovcnt,
+                            const sockaddr* to, socklen_t slen,
+                            UTPOnErrorProc* on_error, void* data)
+{
+    msghdr hdr;
+    memset(&hdr, 0, sizeof hdr);
+    if (to != 0) {
+        hdr.msg_name = const_cast<sockaddr*>(to);
+        hdr.msg_namelen = slen;
+    }
+    hdr.msg_iov = const_cast<iovec*>(iov);
+    hdr.msg_iovlen = iovcnt;
+    for (;;) {
+        ssize_t res = sendmsg(sock, &hdr, 0);
+        if (res >= 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+            // UDP sends are all or nothing, and a datagram dropped because
+            // the socket buffer is full is recovered by uTP retransmission
+            break;
+        } else if (errno != EINTR) {
+            on_error(data, errno);
+            break;
+        }
+    }
+}
+
+void
+UtpDrv::SendBatch::send_run(int first, int last)
+{
+    UTPDRV_TRACER << "SendBatch::send_run: sending " << last-first
+                  << " datagrams on " << dgrams[first].sock
+                  << UTPDRV_TRACE_ENDL;
+#if defined(__linux__)
+    union Control {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        cmsghdr align;
+    };
+    mmsghdr msgs[UTP_SEND_BATCH_MAX];
+    Control ctrls[UTP_SEND_BATCH_MAX];
+    // heads[i] is the first datagram carried by msgs[i], and pinned[i] the
+    // copy of its headers if it is to be sent with MSG_ZEROCOPY
+    int heads[UTP_SEND_BATCH_MAX+1];
+    ErlDrvBinary* pinned[UTP_SEND_BATCH_MAX];
+    int n = 0;
+    memset(msgs, 0, (last-first)*sizeof *msgs);
+    for (int i = first; i < last; ++n) {
+        int end = gso_run(i, last);
+        const Datagram& dg = dgrams[i];
+        const Datagram& tail = dgrams[end-1];
+        msghdr& hdr = msgs[n].msg_hdr;
+        heads[n] = i;
+        pinned[n] = 0;
+        if (dg.zc != 0 && dg.zc->active() && zerocopy_fits(i, end)) {
+            pinned[n] = pin_headers(i, end);
+        }
+        if (dg.has_to) {
+            hdr.msg_name = const_cast<sockaddr_storage*>(&dg.addr.addr);
+            hdr.msg_namelen = dg.addr.slen;
+        }
+        // the iovecs of consecutive datagrams are adjacent, so a
+        // super-datagram simply spans all of theirs
+        hdr.msg_iov = &iovs[dg.iov];
+        hdr.msg_iovlen = tail.iov + tail.iovcnt - dg.iov;
+        if (end - i > 1) {
+            uint16_t segsize = dg.len;
+            hdr.msg_control = ctrls[n].buf;
+            hdr.msg_controllen = sizeof ctrls[n].buf;
+            cmsghdr* cm = CMSG_FIRSTHDR(&hdr);
+            cm->cmsg_level = IPPROTO_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof segsize);
+            memcpy(CMSG_DATA(cm), &segsize, sizeof segsize);
+        }
+        i = end;
+    }
+    heads[n] = last;
+    int sent = 0;
+    while (sent < n) {
+        // MSG_ZEROCOPY applies to a whole sendmmsg call, so zero-copy and
+        // ordinary messages go out in separate calls
+        bool zerocopy = (pinned[sent] != 0);
+        int end = sent + 1;
+        while (end < n && (pinned[end] != 0) == zerocopy) {
+            ++end;
+        }
+        int res = sendmmsg(dgrams[first].sock, msgs+sent, end-sent,
+                           zerocopy ? MSG_ZEROCOPY : 0);
+        if (res > 0) {
+            for (int m = sent; zerocopy && m < sent+res; ++m) {
+                const Datagram& head = dgrams[heads[m]];
+                const Datagram& tail = dgrams[heads[m+1]-1];
+                head.zc->sent(pinned[m], refs + head.ref,
+                              tail.ref + tail.refcnt - head.ref);
+            }
+            sent += res;
+        } else if (res == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (zerocopy && (errno == ENOBUFS || errno == EMSGSIZE)) {
+            // out of memory for pinning pages, or too many fragments for
+            // one skb; copy this one instead
+            driver_free_binary(pinned[sent]);
+            pinned[sent] = 0;
+        } else if (errno != EINTR) {
+            // sendmmsg only fails if the first message could not be sent.
+            // If that was a super-datagram the kernel refused to segment,
+            // stop using GSO for its senders and send its datagrams one by
+            // one; otherwise report the error and carry on with the rest.
+            int head = heads[sent], end = heads[sent+1];
+            if (end - head > 1 && (errno == EIO || errno == EINVAL ||
+                                   errno == ENOPROTOOPT ||
+                                   errno == EOPNOTSUPP)) {
+                UTPDRV_TRACER << "SendBatch::send_run: disabling GSO, errno "
+                              << errno << UTPDRV_TRACE_ENDL;
+                for (int i = head; i < end; ++i) {
+                    *dgrams[i].gso = false;
+                }
+                send_each(head, end);
+            } else {
+                Datagram& dg = dgrams[head];
+                dg.on_error(dg.data, errno);
+            }
+            ++sent;
+        }
+    }
+    for (int m = 0; m < n; ++m) {
+        if (pinned[m] != 0) {
+            driver_free_binary(pinned[m]);
+        }
+    }
+#else
+    send_each(first, last);
+#endif
+}
+
+bool
+UtpDrv::SendBatch::zerocopy_fits(int first, int last) const
+{
+    // A zero-copy skb holds each contiguous run of a page as one fragment,
+    // and the kernel refuses the send if that takes more than
+    // UTP_ZEROCOPY_MAX_FRAGS of them. Every uTP header breaks the run, so
+    // this mostly admits datagrams carrying large packets.
+    size_t total = 0;
+    for (int i = first; i < last; ++i) {
+        total += dgrams[i].len;
+    }
+    if (total < UTP_ZEROCOPY_MIN_BYTES) {
+        return false;
+    }
+    const iovec* iov = &iovs[dgrams[first].iov];
+    const iovec* end = &iovs[dgrams[last-1].iov + dgrams[last-1].iovcnt];
+    uintptr_t prev = 0;
+    int frags = 0;
+    for (; iov < end; ++iov) {
+        if (iov->iov_len == 0) {
+            continue;
+        }
+        uintptr_t lo = reinterpret_cast<uintptr_t>(iov->iov_base);
+        uintptr_t hi = lo + iov->iov_len;
+        frags += (hi - 1)/UTP_PAGE_SIZE - lo/UTP_PAGE_SIZE + 1;
+        if (lo == prev && lo % UTP_PAGE_SIZE != 0) {
+            --frags;
+        }
+        if (frags > UTP_ZEROCOPY_MAX_FRAGS) {
+            return false;
+        }
+        prev = hi;
+    }
+    return true;
+}
+
+ErlDrvBinary*
+UtpDrv::SendBatch::pin_headers(int first, int last)
+{
+    // the kernel may read a zero-copy message after the batch buffer has
+    // been reused, so its headers move to a binary of their own
+    size_t size = 0;
+    for (int i = first; i < last; ++i) {
+        size += iovs[dgrams[i].iov].iov_len;
+    }
+    ErlDrvBinary* bin = driver_alloc_binary(size);
+    if (bin == 0) {
+        return 0;
+    }
+    char* p = bin->orig_bytes;
+    for (int i = first; i < last; ++i) {
+        iovec& iov = iovs[dgrams[i].iov];
+        memcpy(p, iov.iov_base, iov.iov_len);
+        iov.iov_base = p;
+        p += iov.iov_len;
+    }
+    return bin;
+}
+
+int
+UtpDrv::SendBatch::gso_run(int first, int last) const
+{
+    const Datagram& head = dgrams[first];
+    int end = first + 1;
+    if (head.gso == 0 || !*head.gso) {
+        return end;
+    }
+    size_t total = head.len;
+    while (end < last && end - first < UTP_GSO_MAX_SEGS) {
+        const Datagram& dg = dgrams[end];
+        if (dg.gso == 0 || !*dg.gso || dg.len > head.len ||
+            total + dg.len > UTP_GSO_MAX_BYTES ||
+            dg.has_to != head.has_to ||
+            (dg.has_to && !(dg.addr == head.addr))) {
+            break;
+        }
+        total += dg.len;
+        ++end;
+        if (dg.len < head.len) {
+            // only the final segment may be short
+            break;
+        }
+    }
+    return end;
+}
+
+void
+UtpDrv::SendBatch::send_each(int first, int last)
+{
+    for (int i = first; i < last; ++i) {
+        Datagram& dg = dgrams[i];
+        send_one(dg.sock, &iovs[dg.iov], dg.iovcnt, dg.to(), dg.addr.slen,
+                 dg.on_error, dg.data);
+    }
+}
@@ -0,0 +1,302 @@
+#ifndef UTPDRV_UDP_BATCH_H
+#define UTPDRV_UDP_BATCH_H
+
+// -------------------------------------------------------------------
+//
+// udp_batch.h: batched UDP datagram I/O
+//
+// Copyright (c) 2012-2013 Basho Technologies, Inc. All Rights Reserved.
+//
+// This file is provided to you under the Apache License,
+// Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License.  You may obtain
+// a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+//
+// -------------------------------------------------------------------
+
+#include <deque>
+#include <vector>
+#include "libutp/utp.h"
+#include "socket_handler.h"
+
+
+namespace UtpDrv {
+
+// Upper bound on the number of datagrams read per input_ready call; the
+// recv_batch socket option is clamped to this value
+const int UTP_RECV_BATCH_MAX = 64;
+const int UTP_RECV_BATCH_DEFAULT = 16;
+
+// Size of each receive slot; uTP packets never come close to this
+const size_t UTP_DGRAM_SIZE = 8192;
+
+// With UDP_GRO enabled the kernel may hand back a super-datagram of up to
+// 64KB, so the receive buffer is carved into fewer, larger slots
+const size_t UTP_GRO_DGRAM_SIZE = 65536;
+const int UTP_GRO_BATCH_MAX =
+    UTP_RECV_BATCH_MAX*UTP_DGRAM_SIZE/UTP_GRO_DGRAM_SIZE;
+
+// Limits on the number of datagrams and bytes held by a SendBatch before
+// it is flushed
+const int UTP_SEND_BATCH_MAX = 64;
+const size_t UTP_SEND_BATCH_BYTES = 65536;
+
+// Each queued datagram is its header plus up to UTP_MAX_SLICES payload
+// slices referencing queued binaries
+const int UTP_SEND_BATCH_IOVS = UTP_SEND_BATCH_MAX*(UTP_MAX_SLICES+1);
+
+// Limits on a single UDP_SEGMENT super-datagram; the kernel refuses more
+// than 64 segments or a payload that does not fit in one IP datagram
+const int UTP_GSO_MAX_SEGS = 64;
+const size_t UTP_GSO_MAX_BYTES = 65000;
+
+// Datagrams of at least this many bytes, in practice only UDP_SEGMENT
+// super-datagrams, go out with MSG_ZEROCOPY on sockets that ask for it.
+// For anything smaller, pinning the pages and reading back the completion
+// costs more than the copy it saves.
+const size_t UTP_ZEROCOPY_MIN_BYTES = 16384;
+
+// A zero-copy datagram must fit in the kernel's default MAX_SKB_FRAGS page
+// fragments. Assuming 4KB pages overestimates the count on larger pages,
+// which is the safe direction.
+const int UTP_ZEROCOPY_MAX_FRAGS = 17;
+const uintptr_t UTP_PAGE_SIZE = 4096;
+
+// Completions are normally collected when the socket polls readable, but
+// once this many sends are outstanding they are also collected on send
+const size_t UTP_ZEROCOPY_MAX_PENDING = 256;
+
+// How long, in milliseconds, a handler giving up its socket waits for the
+// completions of its outstanding zero-copy sends
+const int UTP_ZEROCOPY_DRAIN_MS = 50;
+
+// RecvBatch drains a non-blocking UDP socket, reading up to a given number
+// of datagrams per call. On Linux a single recvmmsg call fills the whole
+// batch; elsewhere it falls back to a recvfrom loop.
+//
+// If gro is true the socket is expected to have UDP_GRO enabled. Each
+// datagram read may then hold several coalesced packets, all of
+// segment_size bytes except possibly the last, which the caller must split
+// apart again. Datagrams too large for their slot are dropped rather than
+// handed over truncated.
+class RecvBatch
+{
+public:
+    RecvBatch();
+    ~RecvBatch();
+
+    // Read up to count datagrams from sock and return how many were read.
+    // Datagrams are only valid until the next call to recv.
+    int recv(int sock, int count, bool gro = false);
+
+    const byte* data(int i) const { return bufs + offs[i]; }
+    size_t size(int i) const { return lens[i]; }
+    size_t segment_size(int i) const { return segs[i]; }
+    const SockAddr& addr(int i) const { return addrs[i]; }
+
+    // true if the last recv read everything the socket had queued
+    bool drained() const { return emptied; }
+
+private:
+    byte* bufs;
+    size_t slot;
+    bool emptied;
+    size_t offs[UTP_RECV_BATCH_MAX];
+    size_t lens[UTP_RECV_BATCH_MAX];
+    size_t segs[UTP_RECV_BATCH_MAX];
+    SockAddr addrs[UTP_RECV_BATCH_MAX];
+
+    // prevent copies
+    RecvBatch(const RecvBatch&);
+    void operator=(const RecvBatch&);
+};
+
+// ZeroCopy tracks the MSG_ZEROCOPY sends made on one UDP socket. The kernel
+// numbers each such send and may keep reading its pages until it reports
+// the send complete on the socket's error queue, so the binaries a
+// datagram referenced, along with a copy of its headers, stay pinned here
+// until then. If the kernel reports that it had to copy the data after
+// all, as it does on loopback, zero-copy sends are stopped for the socket.
+//
+// Only a handler that reads its own socket sees the error queue, so only
+// such handlers use a ZeroCopy. The engine's SendBatch records sends in it,
+// so it must only be used with the Engine's mutex held.
+class ZeroCopy
+{
+public:
+    ZeroCopy();
+    ~ZeroCopy();
+
+    // Turn SO_ZEROCOPY on or off for sock, returning false if the platform
+    // or kernel does not support it
+    bool enable(int sock, bool on);
+
+    bool enabled() const { return on; }
+
+    // true if sends on the socket should use MSG_ZEROCOPY
+    bool active() const { return on && !copied; }
+
+    bool pending() const { return !sends.empty(); }
+
+    // Record a successful MSG_ZEROCOPY send, taking a reference on its
+    // header copy and on each of the count binaries it referenced
+    void sent(ErlDrvBinary* header, ErlDrvBinary* const* bins, int count);
+
+    // Release the binaries of every send the kernel reports complete
+    void reap();
+
+    // Wait up to UTP_ZEROCOPY_DRAIN_MS for outstanding sends to complete.
+    // Must be called before the socket is closed, since completions can no
+    // longer be read afterwards; the binaries of sends that are still not
+    // complete are never freed.
+    void drain();
+
+private:
+    struct Send {
+        std::vector<ErlDrvBinary*> bins;
+        bool done;
+    };
+
+    void complete(uint32_t lo, uint32_t hi);
+
+    // sends[0] is the send the kernel numbered first_id
+    std::deque<Send> sends;
+    uint32_t first_id;
+    int sock;
+    bool on, copied;
+
+    // prevent copies
+    ZeroCopy(const ZeroCopy&);
+    void operator=(const ZeroCopy&);
+};
+
+// SendBatch collects the datagrams libutp emits while a Scope is open and
+// sends them when the outermost Scope closes, using one sendmmsg call per
+// run of datagrams for the same socket on Linux and a sendto loop
+// elsewhere. Outside of a Scope, datagrams are sent immediately. If a send
+// fails, the error is reported through the on_error callback given to
+// push. A SendBatch must only be used with its Engine's mutex held.
+//
+// On Linux, datagrams pushed with a gso flag that is set are further
+// coalesced: a run of equal-sized datagrams to the same destination, where
+// only the last may be shorter, goes to the kernel as one UDP_SEGMENT
+// super-datagram. If the kernel or the NIC refuses segmentation offload,
+// the flag of each datagram in the run is cleared, turning GSO off for the
+// handlers that own them, and the datagrams are sent individually.
+//
+// Zero-copy packets arrive as a header plus slices of queued binaries. The
+// header is copied, but the payload goes to the kernel straight from the
+// binaries through sendmsg iovecs. A queued datagram holds a reference on
+// each slice's binary until the batch is flushed, since libutp may see the
+// packet acknowledged and release its own references before then. When
+// the datagram carries a ZeroCopy, large sends use MSG_ZEROCOPY and the
+// references pass to the ZeroCopy instead.
+class SendBatch
+{
+public:
+    SendBatch();
+    ~SendBatch();
+
+    // Queue or send a datagram. A null to address means sock is connected.
+    // A non-null gso points to the sender's flag allowing GSO, which must
+    // stay valid until the batch is flushed.
+    void push(int sock, const byte* p, size_t len,
+              const sockaddr* to, socklen_t slen, bool* gso,
+              UTPOnErrorProc* on_error, void* data) {
+        push(sock, p, len, 0, 0, to, slen, gso, on_error, data);
+    }
+
+    // Queue or send a datagram made of a header followed by nslices
+    // payload slices, whose tokens are ErlDrvBinary pointers. A non-null
+    // zc allows a zero-copy send.
+    void push(int sock, const byte* p, size_t len,
+              const UTPSlice* slices, size_t nslices,
+              const sockaddr* to, socklen_t slen, bool* gso,
+              UTPOnErrorProc* on_error, void* data, ZeroCopy* zc = 0);
+
+    // Send everything queued so far. Handlers call this before giving up
+    // their socket so that nothing is left queued for a closed descriptor.
+    void flush();
+
+    class Scope
+    {
+    public:
+        explicit Scope(SendBatch& sb) : batch(sb) { ++batch.depth; }
+        ~Scope() { if (--batch.depth == 0) batch.flush(); }
+
+    private:
+        SendBatch& batch;
+
+        // prevent copies
+        Scope(const Scope&);
+        void operator=(const Scope&);
+    };
+
+private:
+    struct Datagram {
+        const sockaddr* to() const {
+            return has_to ? static_cast<const sockaddr*>(addr) : 0;
+        }
+
+        SockAddr addr;
+        size_t len;
+        int iov, iovcnt;
+        int ref, refcnt;
+        UTPOnErrorProc* on_error;
+        void* data;
+        ZeroCopy* zc;
+        bool* gso;
+        int sock;
+        bool has_to;
+    };
+
+    static void send_one(int sock, const iovec* iov, int iovcnt,
+                         const sockaddr* to, socklen_t slen,
+                         UTPOnErrorProc* on_error, void* data);
+    void send_run(int first, int last);
+    bool zerocopy_fits(int first, int last) const;
+    ErlDrvBinary* pin_headers(int first, int last);
+    int gso_run(int first, int last) const;
+    void send_each(int first, int last);
+
+    byte* buf;
+    Datagram dgrams[UTP_SEND_BATCH_MAX];
+    iovec iovs[UTP_SEND_BATCH_IOVS];
+    ErlDrvBinary* refs[UTP_SEND_BATCH_IOVS];
+    size_t used;
+    int count, depth, niovs, nrefs;
+
+    // prevent copies
+    SendBatch(const SendBatch&);
+    void operator=(const SendBatch&);
+};
+
+// Turn UDP_GRO receive coalescing on or off for sock, returning false if
+// the platform or kernel does not support it
+bool set_udp_gro(int sock, bool on);
+
+// The receive batch is shared by all handlers. All input_ready calls arrive
+// through the main port's ready_input callback and are therefore
+// serialized by its port lock.
+extern RecvBatch recv_batch;
+
+}
+
+
+// this block comment is for emacs, do not delete
+// Local Variables:
+// mode: c++
+// c-file-style: "stroustrup"
+// c-file-offsets: ((innamespace . 0))
+// End:
+
+#endif
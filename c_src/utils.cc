@@ -76,19 +76,55 @@ UtpDrv::create_port(ErlDrvTermData owner, SocketHandler* h)
     return new_port;
 }
 
+bool
+UtpDrv::take_send_mode(ErlIOVec& ev)
+{
+    for (int i = 0; i < ev.vsize; ++i) {
+        SysIOVec& vec = ev.iov[i];
+        if (vec.iov_len != 0) {
+            char* p = static_cast<char*>(vec.iov_base);
+            vec.iov_base = p + 1;
+            vec.iov_len -= 1;
+            ev.size -= 1;
+            return *p != UTP_SEND_ASYNC;
+        }
+    }
+    return true;
+}
+
 void
-UtpDrv::send_not_connected(ErlDrvPort port)
+UtpDrv::send_result(ErlDrvPort port, ErlDrvTermData to, int error,
+                    bool reply)
 {
-    ErlDrvTermData caller = driver_caller(port);
-    ErlDrvTermData term[] = {
-        ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("utp_reply")),
-        ERL_DRV_PORT, driver_mk_port(port),
-        ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("error")),
-        ERL_DRV_ATOM, driver_mk_atom(erl_errno_id(ENOTCONN)),
-        ERL_DRV_TUPLE, 2,
-        ERL_DRV_TUPLE, 3,
-    };
-    driver_send_term(port, caller, term, sizeof term/sizeof *term);
+    if (reply) {
+        if (error == 0) {
+            ErlDrvTermData term[] = {
+                ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("utp_reply")),
+                ERL_DRV_PORT, driver_mk_port(port),
+                ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("ok")),
+                ERL_DRV_TUPLE, 3,
+            };
+            driver_send_term(port, to, term, sizeof term/sizeof *term);
+        } else {
+            ErlDrvTermData term[] = {
+                ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("utp_reply")),
+                ERL_DRV_PORT, driver_mk_port(port),
+                ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("error")),
+                ERL_DRV_ATOM, driver_mk_atom(erl_errno_id(error)),
+                ERL_DRV_TUPLE, 2,
+                ERL_DRV_TUPLE, 3,
+            };
+            driver_send_term(port, to, term, sizeof term/sizeof *term);
+        }
+    } else if (error != 0) {
+        ErlDrvTermData term[] = {
+            ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("utp_error")),
+            ERL_DRV_PORT, driver_mk_port(port),
+            ERL_DRV_ATOM, driver_mk_atom(erl_errno_id(error)),
+            ERL_DRV_TUPLE, 3,
+        };
+        driver_send_term(port, to, term, sizeof term/sizeof *term);
+    }
 }
 
 UtpDrv::NoMemError::NoMemError() : bin(0)
@@ -44,8 +44,16 @@ encode_error(char** rbuf, ErlDrvSizeT rlen, int error);
 extern ErlDrvPort
 create_port(ErlDrvTermData owner, SocketHandler* p);
 
+// Remove the send mode byte from the front of the data of a send, and
+// return true if the sender waits for a reply
+extern bool
+take_send_mode(ErlIOVec& ev);
+
+// Report the outcome of a send. A sender waiting for a reply gets
+// {utp_reply, Port, ok | {error, Reason}}; any other sender hears only of
+// failures, as {utp_error, Port, Reason}.
 extern void
-send_not_connected(ErlDrvPort port);
+send_result(ErlDrvPort port, ErlDrvTermData to, int error, bool reply);
 
 // A static instance of the following class is created up front to hold the
 // binary form of the {error, enomem} Erlang term. The binary is then used
@@ -26,15 +26,16 @@
 #include "globals.h"
 #include "main_handler.h"
 #include "utils.h"
+#include "engine.h"
 
 
 using namespace UtpDrv;
 
-UtpDrv::UtpHandler::UtpHandler(int sock, const SockOpts& so) :
-    SocketHandler(sock, so),
+UtpDrv::UtpHandler::UtpHandler(int sock, const SockOpts& so, Engine* eng) :
+    SocketHandler(sock, so, eng),
     caller(driver_term_nil), utp(0), recv_len(0), status(not_connected), state(0),
-    error_code(0), writable(false), sender_waiting(false), receiver_waiting(false),
-    eof_seen(false)
+    error_code(0), writable(false), receiver_waiting(false),
+    eof_seen(false), busy(false), send_timed_out(false)
 {
 }
 
@@ -45,21 +46,70 @@ UtpDrv::UtpHandler::~UtpHandler()
 void
 UtpDrv::UtpHandler::input_ready()
 {
-    // TODO: when recv buffer sizes can be varied, the following buffer will
-    // need to come from a pool
-    byte buf[8192];
-    SockAddr addr;
-    int len = recvfrom(udp_sock, buf, sizeof buf, 0, addr, &addr.slen);
-    if (len > 0) {
-        MutexLocker lock(utp_mutex);
-        UTP_IsIncomingUTP(&UtpHandler::utp_incoming,
-                          &UtpHandler::send_to, this,
-                          buf, len, addr, addr.slen);
+    if (sockopts.gro && !gro_enabled) {
+        if (set_udp_gro(udp_sock, true)) {
+            gro_enabled = true;
+        } else {
+            UTPDRV_TRACER << "UtpHandler::input_ready: UDP_GRO unavailable for "
+                          << this << UTPDRV_TRACE_ENDL;
+            sockopts.gro = false;
+        }
+    }
+    int count = recv_batch.recv(udp_sock, sockopts.recv_batch, gro_enabled);
+    if (!sockopts.gro && gro_enabled && recv_batch.drained()) {
+        // Coalesced datagrams already queued would come back without
+        // their segment size once UDP_GRO is off, so keep it and the
+        // large slots until a read has emptied the socket
+        if (set_udp_gro(udp_sock, false)) {
+            gro_enabled = false;
+        } else {
+            sockopts.gro = true;
+        }
+    }
+    // the zero-copy state is shared with the engine's SendBatch, so it is
+    // only looked at under the engine lock
+    Engine::Lock lock(engine);
+    if (zerocopy.pending() || sockopts.zerocopy != zerocopy.enabled()) {
+        update_zerocopy();
+    }
+    if (count > 0) {
+        SendBatch::Scope batch(engine->send_batch);
+        for (int i = 0; i < count; ++i) {
+            const SockAddr& addr = recv_batch.addr(i);
+            const byte* p = recv_batch.data(i);
+            size_t left = recv_batch.size(i);
+            size_t seg = recv_batch.segment_size(i);
+            if (seg < left) {
+                ++gro_reads;
+                gro_segments += (left + seg - 1)/seg;
+            }
+            // hand each packet of a coalesced read to libutp separately
+            do {
+                size_t sz = left < seg ? left : seg;
+                UTP_IsIncomingUTP(engine->ctx, &UtpHandler::utp_incoming,
+                                  &UtpHandler::send_to, this,
+                                  p, sz, addr, addr.slen);
+                p += sz;
+                left -= sz;
+            } while (left > 0);
+        }
     }
 }
 
 void
-UtpDrv::UtpHandler::set_utp_callbacks()
+UtpDrv::UtpHandler::update_zerocopy()
+{
+    if (sockopts.zerocopy != zerocopy.enabled() &&
+        !zerocopy.enable(udp_sock, sockopts.zerocopy)) {
+        UTPDRV_TRACER << "UtpHandler::update_zerocopy: SO_ZEROCOPY unavailable "
+                      << "for " << this << UTPDRV_TRACE_ENDL;
+        sockopts.zerocopy = zerocopy.enabled();
+    }
+    zerocopy.reap();
+}
+
+void
+UtpDrv::UtpHandler::set_utp_callbacks(SendToVProc* send_to_v)
 {
     UTPDRV_TRACER << "UtpHandler::set_utp_callbacks " << this << UTPDRV_TRACE_ENDL;
     if (utp != 0) {
@@ -72,6 +122,11 @@ UtpDrv::UtpHandler::set_utp_callbacks()
             &UtpHandler::utp_overhead,
         };
         UTP_SetCallbacks(utp, &funcs, this);
+        // let packets reference the write queue's binaries rather than
+        // copying their payload; send_to_v is called with the send_to
+        // userdata, which is not always this handler
+        UTP_SetZeroCopy(utp, &UtpHandler::utp_write_ref,
+                        &UtpHandler::utp_release, send_to_v);
         UTP_SetSockopt(utp, SO_SNDBUF, UTP_SNDBUF_DEFAULT);
         UTP_SetSockopt(utp, SO_RCVBUF, UTP_RECBUF_DEFAULT);
     }
@@ -83,12 +138,12 @@ UtpDrv::UtpHandler::control(unsigned command, const char* buf, ErlDrvSizeT len,
 {
     UTPDRV_TRACER << "UtpHandler::control " << this << UTPDRV_TRACE_ENDL;
     switch (command) {
-    case UTP_CANCEL_SEND:
-        return cancel_send();
     case UTP_RECV:
         return recv(buf, len, rbuf, rlen);
     case UTP_CANCEL_RECV:
         return cancel_recv();
+    case UTP_RECV_ACK:
+        return recv_ack(buf, len);
     case UTP_SETOPTS:
         return setopts(buf, len, rbuf, rlen);
     }
@@ -105,7 +160,7 @@ UtpDrv::UtpHandler::peername(const char* buf, ErlDrvSizeT len,
     }
     SockAddr addr;
     {
-        MutexLocker lock(utp_mutex);
+        Engine::Lock lock(engine);
         UTP_GetPeerName(utp, addr, &addr.slen);
     }
     return addr.encode(rbuf, rlen);
@@ -115,101 +170,121 @@ void
 UtpDrv::UtpHandler::outputv(ErlIOVec& ev)
 {
     UTPDRV_TRACER << "UtpHandler::outputv " << this << UTPDRV_TRACE_ENDL;
+    ErlDrvTermData local_caller = driver_caller(port);
+    bool reply = take_send_mode(ev);
     if (status != connected || utp == 0) {
-        send_not_connected(port);
+        send_result(port, local_caller, ENOTCONN, reply);
         return;
     }
 
-    ErlDrvTermData local_caller, utp_reply;
-    local_caller = driver_caller(port);
-    utp_reply = driver_mk_atom(const_cast<char*>("utp_reply"));
-    size_t write_total = 0;
-    if (writable) {
+    bool timed_out;
+    {
+        Engine::Lock lock(engine);
+        timed_out = send_timed_out;
+        if (!timed_out && sockopts.send_tmout == 0) {
+            // with a zero send timeout, refuse the data rather than wait
+            timed_out = write_queue.size() >= sockopts.high_watermark;
+        }
+    }
+    if (timed_out) {
+        send_result(port, local_caller, ETIMEDOUT, reply);
+        return;
+    }
+
+    bool set_busy = false;
+    {
+        Engine::Lock lock(engine);
         if (ev.size > 0) {
-            if (sockopts.packet > 0) {
-                ErlDrvBinary* pbin = driver_alloc_binary(sockopts.packet);
+            // lines carry their own framing
+            if (sockopts.packet != 0 && sockopts.packet != UTP_PACKET_LINE) {
                 union {
-                    char* p1;
-                    uint16_t* p2;
-                    uint32_t* p4;
+                    unsigned char p1;
+                    uint16_t p2;
+                    uint32_t p4;
                 };
-                p1 = pbin->orig_bytes;
                 switch (sockopts.packet) {
                 case 1:
-                    *p1 = ev.size & 0xFF;
+                    p1 = ev.size & 0xFF;
                     break;
                 case 2:
-                    *p2 = htons(ev.size & 0xFFFF);
+                    p2 = htons(ev.size & 0xFFFF);
                     break;
                 case 4:
-                    *p4 = htonl(ev.size & 0xFFFFFFFF);
+                    p4 = htonl(ev.size & 0xFFFFFFFF);
                     break;
                 }
-                write_queue.push_back(pbin);
-                write_total += sockopts.packet;
+                write_queue.push_back(&p4, sockopts.packet);
             }
             for (int i = 0; i < ev.vsize; ++i) {
-                ErlDrvBinary* bin = 0;
-                if (ev.binv[i] != 0) {
-                    bin = ev.binv[i];
-                    driver_binary_inc_refc(bin);
-                } else if (ev.iov[i].iov_len > 0) {
-                    const SysIOVec& vec = ev.iov[i];
-                    bin = driver_alloc_binary(vec.iov_len);
-                    memcpy(bin->orig_bytes, vec.iov_base, vec.iov_len);
+                const SysIOVec& vec = ev.iov[i];
+                if (vec.iov_len == 0) {
+                    continue;
                 }
+                ErlDrvBinary* bin = ev.binv[i];
                 if (bin != 0) {
-                    write_queue.push_back(bin);
+                    // the vector may point into the middle of the binary
+                    const char* base =
+                        reinterpret_cast<const char*>(vec.iov_base);
+                    write_queue.push_back(bin, base - bin->orig_bytes,
+                                          vec.iov_len);
+                } else {
+                    write_queue.push_back(vec.iov_base, vec.iov_len);
                 }
             }
-            write_total += ev.size;
         }
-        {
-            MutexLocker lock(utp_mutex);
-            writable = UTP_Write(utp, write_total);
+        // when libutp's window is full, the UTP_STATE_WRITABLE callback
+        // writes whatever has queued up in the meantime
+        if (writable) {
+            SendBatch::Scope batch(engine->send_batch);
+            writable = UTP_Write(utp, write_queue.size());
         }
-        ErlDrvTermData term[] = {
-            ERL_DRV_ATOM, utp_reply,
-            ERL_DRV_PORT, driver_mk_port(port),
-            ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("ok")),
-            ERL_DRV_TUPLE, 3,
-        };
-        driver_send_term(port, local_caller, term, sizeof term/sizeof *term);
-    } else {
-        if (sockopts.send_tmout == 0) {
-            ErlDrvTermData term[] = {
-                ERL_DRV_ATOM, utp_reply,
-                ERL_DRV_PORT, driver_mk_port(port),
-                ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("error")),
-                ERL_DRV_ATOM, driver_mk_atom(erl_errno_id(ETIMEDOUT)),
-                ERL_DRV_TUPLE, 2,
-                ERL_DRV_TUPLE, 3,
-            };
-            driver_send_term(port, local_caller, term, sizeof term/sizeof *term);
-        } else {
-            {
-                MutexLocker lock(utp_mutex);
-                caller = local_caller;
-                sender_waiting = true;
-            }
-            ErlDrvTermData term[12] = {
-                ERL_DRV_ATOM, utp_reply,
-                ERL_DRV_PORT, driver_mk_port(port),
-                ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("wait")),
-            };
-            size_t size = 6;
-            if (sockopts.send_tmout == -1) {
-                term[size++] = ERL_DRV_TUPLE;
-                term[size++] = 3;
-            } else {
-                term[size++] = ERL_DRV_UINT;
-                term[size++] = sockopts.send_tmout;
-                term[size++] = ERL_DRV_TUPLE;
-                term[size++] = 2;
-                term[size++] = ERL_DRV_TUPLE;
-                term[size++] = 3;
-            }
-            driver_send_term(port, local_caller, term, size);
+        set_busy = !busy && sockopts.send_tmout != 0 &&
+            write_queue.size() >= sockopts.high_watermark;
+        if (set_busy) {
+            // further port commands suspend their callers until the queue
+            // drains to the low watermark, which do_write and
+            // do_write_ref notice as they take data from it
+            busy = true;
+            set_busy_port(port, 1);
+        }
+    }
+    if (set_busy && sockopts.send_tmout > 0) {
+        driver_set_timer(port, sockopts.send_tmout);
+    }
+    send_result(port, local_caller, 0, reply);
+}
+
+void
+UtpDrv::UtpHandler::timeout()
+{
+    UTPDRV_TRACER << "UtpHandler::timeout " << this << UTPDRV_TRACE_ENDL;
+    // the port has been busy for the whole send timeout
+    Engine::Lock lock(engine);
+    check_drained();
+    if (busy) {
+        // resume the suspended senders only to fail their sends, along
+        // with any others made before the queue drains
+        busy = false;
+        send_timed_out = true;
+        set_busy_port(port, 0);
+    }
+}
+
+void
+UtpDrv::UtpHandler::check_drained()
+{
+    // called with engine->mutex held, whenever the write queue shrinks
+    if (!busy && !send_timed_out) {
+        return;
+    }
+    // setopts may have left the low watermark above the high one
+    size_t low = sockopts.low_watermark < sockopts.high_watermark ?
+        sockopts.low_watermark : sockopts.high_watermark;
+    if (write_queue.size() <= low) {
+        send_timed_out = false;
+        if (busy) {
+            busy = false;
+            set_busy_port(port, 0);
         }
     }
 }
@@ -218,14 +293,16 @@ void
 UtpDrv::UtpHandler::stop()
 {
     UTPDRV_TRACER << "UtpHandler::stop " << this << UTPDRV_TRACE_ENDL;
-    if (utp != 0) {
-        MutexLocker lock(utp_mutex);
-        close_utp();
-    }
-    ErlDrvSizeT qsize = driver_sizeq(port);
-    if (qsize != 0) {
-        driver_deq(port, qsize);
+    {
+        Engine::Lock lock(engine);
+        if (utp != 0) {
+            close_utp();
+        }
+        read_queue.clear();
+        read_count.clear();
+        parser.reset();
     }
+    driver_cancel_timer(port);
     if (status == destroying) {
         delete this;
     } else {
@@ -255,6 +332,9 @@ UtpDrv::UtpHandler::setopts(const char* buf, ErlDrvSizeT len,
     if (saved_recbuf != sockopts.recbuf) {
         UTP_SetSockopt(utp, SO_RCVBUF, sockopts.recbuf);
     }
+    // a raised low watermark may release a busy port right away
+    Engine::Lock lock(engine);
+    check_drained();
     return result;
 }
 
@@ -269,7 +349,7 @@ UtpDrv::UtpHandler::close(const char* buf, ErlDrvSizeT len,
     const char* retval = "ok";
     if (!close_pending &&
         (eof_seen || (status != closing && status != destroying))) {
-        MutexLocker lock(utp_mutex);
+        Engine::Lock lock(engine);
         status = closing;
         close_pending = true;
         eof_seen = false;
@@ -324,12 +404,11 @@ UtpDrv::UtpHandler::recv(const char* buf, ErlDrvSizeT len,
     ErlDrvTermData local_caller = driver_caller(port);
     Receiver rcvr(false, local_caller, ref);
     ErlDrvSizeT qsize = 1; // any non-zero value will do
+    Engine::Lock lock(engine);
     bool sent = emit_read_buffer(length, rcvr, qsize);
-    if (sent && qsize == 0) {
-        MutexLocker lock(utp_mutex);
+    if (sent && qsize == 0 && utp != 0) {
         UTP_RBDrained(utp);
     } if (!sent) {
-        MutexLocker lock(utp_mutex);
         caller_ref.swap(ref);
         caller = local_caller;
         recv_len = length;
@@ -342,24 +421,49 @@ UtpDrv::UtpHandler::recv(const char* buf, ErlDrvSizeT len,
 }
 
 ErlDrvSSizeT
-UtpDrv::UtpHandler::cancel_send()
+UtpDrv::UtpHandler::cancel_recv()
 {
-    UTPDRV_TRACER << "UtpHandler::cancel_send " << this << UTPDRV_TRACE_ENDL;
-    MutexLocker lock(utp_mutex);
-    sender_waiting = false;
-    caller = driver_term_nil;
+    UTPDRV_TRACER << "UtpHandler::cancel_recv " << this << UTPDRV_TRACE_ENDL;
+    Engine::Lock lock(engine);
+    reset_waiting_recv();
     return 0;
 }
 
 ErlDrvSSizeT
-UtpDrv::UtpHandler::cancel_recv()
+UtpDrv::UtpHandler::recv_ack(const char* buf, ErlDrvSizeT len)
 {
-    UTPDRV_TRACER << "UtpHandler::cancel_recv " << this << UTPDRV_TRACE_ENDL;
-    MutexLocker lock(utp_mutex);
-    reset_waiting_recv();
+    UTPDRV_TRACER << "UtpHandler::recv_ack " << this << UTPDRV_TRACE_ENDL;
+    unsigned long bytes;
+    try {
+        EiDecoder decoder(buf, len);
+        decoder.ulongval(bytes);
+    } catch (const EiError&) {
+        return reinterpret_cast<ErlDrvSSizeT>(ERL_DRV_ERROR_BADARG);
+    }
+    Engine::Lock lock(engine);
+    if (ack_delivered(bytes) && sockopts.active != ACTIVE_FALSE) {
+        Receiver rcvr;
+        ErlDrvSizeT qsize;
+        emit_read_buffer(0, rcvr, qsize);
+    }
+    // the acknowledged bytes no longer count against the receive window,
+    // so let libutp advertise the room
+    if (utp != 0 && bytes != 0) {
+        UTP_RBDrained(utp);
+    }
     return 0;
 }
 
+void
+UtpDrv::UtpHandler::abort_read()
+{
+    UTPDRV_TRACER << "UtpHandler::abort_read " << this << UTPDRV_TRACE_ENDL;
+    // drop unsent data too, since close_utp waits for it
+    write_queue.clear();
+    check_drained();
+    close_utp();
+}
+
 void
 UtpDrv::UtpHandler::close_utp()
 {
@@ -389,19 +493,21 @@ UtpDrv::UtpHandler::do_send_to(const byte* p, size_t len,
 {
     UTPDRV_TRACER << "UtpHandler::do_send_to " << this << UTPDRV_TRACE_ENDL;
     if (udp_sock != INVALID_SOCKET) {
-        int index = 0;
-        for (;;) {
-            ssize_t count = sendto(udp_sock, p+index, len-index, 0, to, slen);
-            if (count == ssize_t(len-index)) {
-                break;
-            } else if (count < 0 && errno != EINTR &&
-                       errno != EAGAIN && errno != EWOULDBLOCK) {
-                do_error(errno);
-                break;
-            } else {
-                index += count;
-            }
-        }
+        engine->send_batch.push(udp_sock, p, len, to, slen, gso_flag(),
+                                &UtpHandler::utp_error, this);
+    }
+}
+
+void
+UtpDrv::UtpHandler::do_send_to_v(const byte* p, size_t len,
+                                 const UTPSlice* slices, size_t nslices,
+                                 const sockaddr* to, socklen_t slen)
+{
+    UTPDRV_TRACER << "UtpHandler::do_send_to_v " << this << UTPDRV_TRACE_ENDL;
+    if (udp_sock != INVALID_SOCKET) {
+        engine->send_batch.push(udp_sock, p, len, slices, nslices, to, slen,
+                                gso_flag(), &UtpHandler::utp_error, this,
+                                zerocopy.active() ? &zerocopy : 0);
     }
 }
 
@@ -409,10 +515,13 @@ void
 UtpDrv::UtpHandler::do_read(const byte* bytes, size_t count)
 {
     UTPDRV_TRACER << "UtpHandler::do_read " << this << UTPDRV_TRACE_ENDL;
+    if (parser.failed()) {
+        // framing broke down and the connection is being closed
+        return;
+    }
     if (count != 0) {
         ErlDrvSizeT qsize = 1; // any non-zero value will do
-        char* buf = const_cast<char*>(reinterpret_cast<const char*>(bytes));
-        driver_enq(port, buf, count);
+        read_queue.push_back(bytes, count);
         read_count.push_back(count);
         if (sockopts.active == ACTIVE_FALSE) {
             if (receiver_waiting) {
@@ -425,7 +534,7 @@ UtpDrv::UtpHandler::do_read(const byte* bytes, size_t count)
             Receiver rcvr;
             emit_read_buffer(0, rcvr, qsize);
         }
-        if (qsize == 0) {
+        if (qsize == 0 && utp != 0) {
             UTP_RBDrained(utp);
         }
     }
@@ -438,13 +547,27 @@ UtpDrv::UtpHandler::do_write(byte* bytes, size_t count)
                   << ": writing " << count << " bytes" << UTPDRV_TRACE_ENDL;
     if (count == 0) return;
     write_queue.pop_bytes(bytes, count);
+    check_drained();
+}
+
+size_t
+UtpDrv::UtpHandler::do_write_ref(UTPSlice* slices, size_t max_slices,
+                                 size_t count)
+{
+    UTPDRV_TRACER << "UtpHandler::do_write_ref " << this
+                  << ": referencing " << count << " bytes" << UTPDRV_TRACE_ENDL;
+    size_t nslices = write_queue.pop_slices(slices, max_slices, count);
+    check_drained();
+    return nslices;
 }
 
 size_t
 UtpDrv::UtpHandler::do_get_rb_size()
 {
     UTPDRV_TRACER << "UtpHandler::do_get_rb_size " << this << UTPDRV_TRACE_ENDL;
-    return status == connected ? driver_sizeq(port) : 0;
+    // data the owner has not acknowledged still occupies the receive
+    // buffer, so that a slow owner throttles the sender
+    return status == connected ? read_queue.size() + recv_unacked : 0;
 }
 
 void
@@ -457,6 +580,7 @@ UtpDrv::UtpHandler::do_state_change(int s)
     switch (state) {
     case UTP_STATE_EOF:
         write_queue.clear();
+        check_drained();
         if (status != stopped) {
             close_utp();
         }
@@ -472,16 +596,6 @@ UtpDrv::UtpHandler::do_state_change(int s)
                 writable = UTP_Write(utp, sz);
             }
         }
-        if (writable && sender_waiting) {
-            ErlDrvTermData term[] = {
-                ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("utp_reply")),
-                ERL_DRV_PORT, driver_mk_port(port),
-                ERL_DRV_ATOM, driver_mk_atom(const_cast<char*>("retry")),
-                ERL_DRV_TUPLE, 3,
-            };
-            driver_send_term(port, caller, term, sizeof term/sizeof *term);
-            sender_waiting = false;
-        }
         if (close_pending) {
             close_utp();
         }
@@ -501,6 +615,10 @@ UtpDrv::UtpHandler::do_state_change(int s)
         break;
 
     case UTP_STATE_DESTROYING:
+        engine->send_batch.flush();
+        // the socket is about to be closed, and the kernel may still be
+        // reading the binaries of zero-copy sends
+        zerocopy.drain();
         if (selected) {
             UTPDRV_TRACER << "UtpHandler::do_state_change: deselecting "
                           << udp_sock << " for " << this << UTPDRV_TRACE_ENDL;
@@ -602,6 +720,29 @@ UtpDrv::UtpHandler::utp_write(void* data, byte* bytes, size_t count)
     (static_cast<UtpHandler*>(data))->do_write(bytes, count);
 }
 
+size_t
+UtpDrv::UtpHandler::utp_write_ref(void* data, UTPSlice* slices,
+                                  size_t max_slices, size_t count)
+{
+    return (static_cast<UtpHandler*>(data))->do_write_ref(slices, max_slices,
+                                                          count);
+}
+
+void
+UtpDrv::UtpHandler::utp_release(void* token)
+{
+    driver_free_binary(static_cast<ErlDrvBinary*>(token));
+}
+
+void
+UtpDrv::UtpHandler::send_to_v(void* data, const byte* p, size_t len,
+                              const UTPSlice* slices, size_t nslices,
+                              const sockaddr* to, socklen_t slen)
+{
+    (static_cast<UtpHandler*>(data))->do_send_to_v(p, len, slices, nslices,
+                                                   to, slen);
+}
+
 size_t
 UtpDrv::UtpHandler::utp_get_rb_size(void* data)
 {
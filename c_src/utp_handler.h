@@ -28,6 +28,7 @@
 #include "utils.h"
 #include "drv_types.h"
 #include "write_queue.h"
+#include "udp_batch.h"
 
 
 namespace UtpDrv {
@@ -39,6 +40,8 @@ public:
 
     void outputv(ErlIOVec& ev);
 
+    void timeout();
+
     void stop();
 
     void input_ready();
@@ -47,6 +50,12 @@ public:
                         const sockaddr* to, socklen_t slen);
     static void utp_read(void* data, const byte* bytes, size_t count);
     static void utp_write(void* data, byte* bytes, size_t count);
+    static size_t utp_write_ref(void* data, UTPSlice* slices,
+                                size_t max_slices, size_t count);
+    static void utp_release(void* token);
+    static void send_to_v(void* data, const byte* p, size_t len,
+                          const UTPSlice* slices, size_t nslices,
+                          const sockaddr* to, socklen_t slen);
     static size_t utp_get_rb_size(void* data);
     static void utp_state_change(void* data, int state);
     static void utp_error(void* data, int errcode);
@@ -54,9 +63,9 @@ public:
     static void utp_incoming(void* data, UTPSocket* utp);
 
 protected:
-    UtpHandler(int sock, const SockOpts& so);
+    UtpHandler(int sock, const SockOpts& so, Engine* eng);
 
-    void set_utp_callbacks();
+    void set_utp_callbacks(SendToVProc* send_to_v = &UtpHandler::send_to_v);
     void set_empty_utp_callbacks();
 
     ErlDrvSSizeT
@@ -75,19 +84,30 @@ protected:
     virtual ErlDrvSSizeT
     recv(const char* buf, ErlDrvSizeT len, char** rbuf, ErlDrvSizeT rlen);
 
-    ErlDrvSSizeT cancel_send();
     ErlDrvSSizeT cancel_recv();
+    ErlDrvSSizeT recv_ack(const char* buf, ErlDrvSizeT len);
 
     ErlDrvSSizeT new_controlling_process();
 
     void close_utp();
 
+    void abort_read();
+
+    void check_drained();
+
+    void update_zerocopy();
+
     void reset_waiting_recv();
 
     virtual void do_send_to(const byte* p, size_t len, const sockaddr* to,
                             socklen_t slen);
     virtual void do_read(const byte* bytes, size_t count);
     virtual void do_write(byte* bytes, size_t count);
+    virtual size_t do_write_ref(UTPSlice* slices, size_t max_slices,
+                                size_t count);
+    virtual void do_send_to_v(const byte* p, size_t len,
+                              const UTPSlice* slices, size_t nslices,
+                              const sockaddr* to, socklen_t slen);
     virtual size_t do_get_rb_size();
     virtual void do_state_change(int state);
     virtual void do_error(int errcode);
@@ -106,13 +126,22 @@ protected:
     };
 
     WriteQueue write_queue;
+    // MSG_ZEROCOPY sends on udp_sock; only enabled by handlers that read
+    // their own socket, since completions arrive on its error queue
+    ZeroCopy zerocopy;
     Binary caller_ref;
     ErlDrvTermData caller;
     UTPSocket* utp;
     ErlDrvSizeT recv_len;
     UtpPortStatus status;
     int state, error_code;
-    bool writable, sender_waiting, receiver_waiting, eof_seen;
+    bool writable, receiver_waiting, eof_seen;
+    // busy is set while the port is busy because the write queue reached
+    // the high watermark; send_timed_out fails every send from the time the
+    // send timeout expires while busy until the queue drains to the low
+    // watermark. Both are guarded by engine->mutex, since the queue drains
+    // in whichever port's context libutp sends from.
+    bool busy, send_timed_out;
 };
 
 }
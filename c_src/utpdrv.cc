@@ -21,6 +21,7 @@
 // -------------------------------------------------------------------
 
 #include <unistd.h>
+#include <string.h>
 #include "erl_driver.h"
 #include "globals.h"
 #include "main_handler.h"
@@ -43,7 +44,9 @@ utp_finish()
 static ErlDrvData
 utp_start(ErlDrvPort port, char* command)
 {
-    MainHandler* drv = new MainHandler(port);
+    // "utpdrv hires_timer" selects the high resolution timer
+    bool hires = strstr(command, "hires_timer") != 0;
+    MainHandler* drv = new MainHandler(port, hires);
     drv->start();
     return reinterpret_cast<ErlDrvData>(drv);
 }
@@ -56,10 +59,10 @@ utp_stop(ErlDrvData drv_data)
 }
 
 static void
-utp_check_timeouts(ErlDrvData drv_data)
+utp_timeout(ErlDrvData drv_data)
 {
-    MainHandler* drv = reinterpret_cast<MainHandler*>(drv_data);
-    drv->check_utp_timeouts();
+    Handler* drv = reinterpret_cast<Handler*>(drv_data);
+    drv->timeout();
 }
 
 static void
@@ -110,7 +113,7 @@ static ErlDrvEntry drv_entry = {
     utp_finish,
     0,
     utp_control,
-    utp_check_timeouts,
+    utp_timeout,
     utp_outputv,
     0,
     0,
@@ -20,68 +20,199 @@
 //
 // -------------------------------------------------------------------
 
+#include <string.h>
 #include "write_queue.h"
 
 
 using namespace UtpDrv;
 
-UtpDrv::WriteQueue::WriteQueue() : sz(0), offset(0)
+// initial number of ring slots, must be a power of 2
+static const size_t UTP_WRITE_RING_INITIAL = 16;
+
+UtpDrv::WriteQueue::WriteQueue() :
+    ring(0), ring_size(0), ring_head(0), ring_len(0), chunk(0), nspares(0),
+    chunk_used(0), sz(0)
 {
 }
 
-UtpDrv::WriteQueue::WriteQueue(const WriteQueue& wq) :
-    sz(wq.sz), offset(wq.offset)
+UtpDrv::WriteQueue::~WriteQueue()
 {
-    BinaryQueue::const_iterator it = wq.queue.begin();
-    while (it != wq.queue.end()) {
-        driver_binary_inc_refc(*it);
-        queue.push_back(*it++);
+    clear();
+    if (chunk != 0) {
+        driver_free_binary(chunk);
+    }
+    for (size_t i = 0; i < nspares; ++i) {
+        driver_free_binary(spares[i]);
+    }
+    if (ring != 0) {
+        driver_free(ring);
     }
 }
 
-UtpDrv::WriteQueue::~WriteQueue()
+void
+UtpDrv::WriteQueue::push_back(ErlDrvBinary* bin, size_t offset, size_t count)
+{
+    if (count < UTP_WRITE_COPY_LIMIT) {
+        push_back(bin->orig_bytes + offset, count);
+    } else if (count != 0) {
+        driver_binary_inc_refc(bin);
+        push_segment(bin, offset, count);
+    }
+}
+
+void
+UtpDrv::WriteQueue::push_back(const void* bytes, size_t count)
 {
-    BinaryQueue::iterator it = queue.begin();
-    while (it != queue.end()) {
-        driver_free_binary(*it++);
+    const char* from = reinterpret_cast<const char*>(bytes);
+    while (count > 0) {
+        if (chunk != 0 && driver_binary_get_refc(chunk) == 1) {
+            // nothing queued refers to the chunk, so start over at its
+            // beginning
+            chunk_used = 0;
+        }
+        if (chunk == 0 || chunk_used == UTP_WRITE_CHUNK_SIZE) {
+            // pick the next chunk before retiring the full one, so the
+            // oldest spare gets a chance to be reused rather than evicted
+            ErlDrvBinary* next = new_chunk();
+            if (chunk != 0) {
+                retire_chunk(chunk);
+            }
+            chunk = next;
+            chunk_used = 0;
+        }
+        size_t to_copy = UTP_WRITE_CHUNK_SIZE - chunk_used;
+        if (to_copy > count) {
+            to_copy = count;
+        }
+        memcpy(chunk->orig_bytes + chunk_used, from, to_copy);
+        Segment* last = ring_len == 0 ? 0 :
+            &ring[(ring_head + ring_len - 1) & (ring_size - 1)];
+        if (last != 0 && last->bin == chunk &&
+            last->offset + last->len == chunk_used) {
+            last->len += to_copy;
+            sz += to_copy;
+        } else {
+            driver_binary_inc_refc(chunk);
+            push_segment(chunk, chunk_used, to_copy);
+        }
+        chunk_used += to_copy;
+        from += to_copy;
+        count -= to_copy;
     }
 }
 
 void
-UtpDrv::WriteQueue::push_back(ErlDrvBinary* bin)
+UtpDrv::WriteQueue::push_segment(ErlDrvBinary* bin, size_t offset,
+                                 size_t count)
 {
-    queue.push_back(bin);
-    sz += bin->orig_size;
+    if (ring_len == ring_size) {
+        size_t new_size = ring_size == 0 ? UTP_WRITE_RING_INITIAL : ring_size*2;
+        Segment* new_ring =
+            reinterpret_cast<Segment*>(driver_alloc(new_size*sizeof *ring));
+        for (size_t i = 0; i < ring_len; ++i) {
+            new_ring[i] = ring[(ring_head + i) & (ring_size - 1)];
+        }
+        if (ring != 0) {
+            driver_free(ring);
+        }
+        ring = new_ring;
+        ring_size = new_size;
+        ring_head = 0;
+    }
+    Segment& seg = ring[(ring_head + ring_len) & (ring_size - 1)];
+    seg.bin = bin;
+    seg.offset = offset;
+    seg.len = count;
+    ++ring_len;
+    sz += count;
 }
 
 void
 UtpDrv::WriteQueue::pop_bytes(void* buf, size_t count)
 {
     char* to = reinterpret_cast<char*>(buf);
-    while (count > 0) {
-        ErlDrvBinary* bin = queue.front();
-        ErlDrvSizeT bsize = bin->orig_size;
-        if (bsize - offset > count) {
-            memcpy(to, bin->orig_bytes+offset, count);
-            offset += count;
+    while (count > 0 && ring_len > 0) {
+        Segment& seg = ring[ring_head];
+        if (seg.len > count) {
+            memcpy(to, seg.bin->orig_bytes + seg.offset, count);
+            seg.offset += count;
+            seg.len -= count;
             sz -= count;
             break;
-        } else {
-            size_t to_copy = bsize - offset;
-            memcpy(to, bin->orig_bytes+offset, to_copy);
-            queue.pop_front();
-            driver_free_binary(bin);
-            offset = 0;
-            count -= to_copy;
-            sz -= to_copy;
-            to += to_copy;
         }
+        memcpy(to, seg.bin->orig_bytes + seg.offset, seg.len);
+        to += seg.len;
+        count -= seg.len;
+        pop_front();
     }
 }
 
+size_t
+UtpDrv::WriteQueue::pop_slices(UTPSlice* slices, size_t max_slices,
+                               size_t count)
+{
+    size_t n = 0;
+    while (count > 0 && n < max_slices && ring_len > 0) {
+        Segment& seg = ring[ring_head];
+        UTPSlice& slice = slices[n++];
+        slice.bytes = reinterpret_cast<const byte*>(seg.bin->orig_bytes +
+                                                    seg.offset);
+        slice.token = seg.bin;
+        driver_binary_inc_refc(seg.bin);
+        if (seg.len > count) {
+            slice.len = count;
+            seg.offset += count;
+            seg.len -= count;
+            sz -= count;
+            break;
+        }
+        slice.len = seg.len;
+        count -= seg.len;
+        pop_front();
+    }
+    return n;
+}
+
+void
+UtpDrv::WriteQueue::pop_front()
+{
+    Segment& seg = ring[ring_head];
+    sz -= seg.len;
+    driver_free_binary(seg.bin);
+    ring_head = (ring_head + 1) & (ring_size - 1);
+    --ring_len;
+}
+
+ErlDrvBinary*
+UtpDrv::WriteQueue::new_chunk()
+{
+    // reuse the oldest retired chunk that nothing else refers to anymore
+    for (size_t i = 0; i < nspares; ++i) {
+        if (driver_binary_get_refc(spares[i]) == 1) {
+            ErlDrvBinary* bin = spares[i];
+            memmove(spares+i, spares+i+1, (nspares-i-1)*sizeof *spares);
+            --nspares;
+            return bin;
+        }
+    }
+    return driver_alloc_binary(UTP_WRITE_CHUNK_SIZE);
+}
+
+void
+UtpDrv::WriteQueue::retire_chunk(ErlDrvBinary* bin)
+{
+    if (nspares == UTP_WRITE_SPARE_CHUNKS) {
+        driver_free_binary(spares[0]);
+        memmove(spares, spares+1, (nspares-1)*sizeof *spares);
+        --nspares;
+    }
+    spares[nspares++] = bin;
+}
+
 void
 UtpDrv::WriteQueue::clear()
 {
-    queue.clear();
-    sz = offset = 0;
+    while (ring_len > 0) {
+        pop_front();
+    }
 }
@@ -23,36 +23,81 @@
 //
 // -------------------------------------------------------------------
 
-#include <list>
 #include "erl_driver.h"
+#include "libutp/utp.h"
 
 
 namespace UtpDrv {
 
+// Size of the chunks small writes are copied into
+const size_t UTP_WRITE_CHUNK_SIZE = 16384;
+
+// Number of retired chunks kept for reuse. libutp packets reference the
+// chunks until they are acknowledged, so a chunk can only be refilled once
+// the data it held has left the send window, which by default holds 16KB.
+const size_t UTP_WRITE_SPARE_CHUNKS = 2;
+
+// Refcounted binaries at least this large are queued by reference; smaller
+// data is cheaper to copy than to track
+const size_t UTP_WRITE_COPY_LIMIT = 512;
+
+// WriteQueue holds data waiting for libutp to packetize it. Segments sit
+// in a ring that only reallocates when it fills up. Small writes are
+// copied back to back into a pooled chunk, so a run of them coalesces into
+// one segment and pop_bytes can usually fill a packet with one memcpy.
+// Packet length headers are written into the chunk the same way, so
+// framing a message allocates nothing once the chunks are recycling.
+// With zero-copy transmit, pop_slices instead hands libutp references to
+// the queued binaries, which its packets hold until acknowledged.
 class WriteQueue
 {
 public:
     WriteQueue();
-    WriteQueue(const WriteQueue&);
     ~WriteQueue();
 
-    void push_back(ErlDrvBinary* bin);
+    // Queue count bytes of bin starting at offset, by reference if the
+    // binary is large enough and by copying otherwise
+    void push_back(ErlDrvBinary* bin, size_t offset, size_t count);
+    void push_back(const void* bytes, size_t count);
+
     void pop_bytes(void* to, size_t count);
 
+    // Remove up to count bytes from the front of the queue as at most
+    // max_slices slices, returning the number of slices filled. Each
+    // slice's token is an ErlDrvBinary reference owned by the caller.
+    size_t pop_slices(UTPSlice* slices, size_t max_slices, size_t count);
+
     size_t size() const { return sz; }
 
     void clear();
 
 private:
-    typedef std::list<ErlDrvBinary*> BinaryQueue;
-    BinaryQueue queue;
-    size_t sz, offset;
+    struct Segment {
+        ErlDrvBinary* bin;
+        size_t offset, len;
+    };
+
+    void push_segment(ErlDrvBinary* bin, size_t offset, size_t count);
+    void pop_front();
+    ErlDrvBinary* new_chunk();
+    void retire_chunk(ErlDrvBinary* bin);
+
+    Segment* ring;
+    size_t ring_size, ring_head, ring_len;
+    // the chunk being filled, and retired chunks oldest first; the queue
+    // holds one reference on each
+    ErlDrvBinary* chunk;
+    ErlDrvBinary* spares[UTP_WRITE_SPARE_CHUNKS];
+    size_t nspares, chunk_used, sz;
+
+    // prevent copies
+    WriteQueue(const WriteQueue&);
+    void operator=(const WriteQueue&);
 };
 
 }
 
 
-
 // this block comment is for emacs, do not delete
 // Local Variables:
 // mode: c++
@@ -30,9 +30,9 @@
 -endif.
 
 -export([start_link/0, start/0, stop/0,
-         listen/1, listen/2, accept/1, accept/2, async_accept/1,
+         listen/1, listen/2, accept/1, accept/2, async_accept/1, shards/1,
          connect/2, connect/3, connect/4,
-         close/1, send/2, recv/2, recv/3,
+         close/1, send/2, send_async/2, recv/2, recv/3, recv_ack/2,
          sockname/1, peername/1, port/1,
          setopts/2, getopts/2,
          controlling_process/2]).
@@ -54,9 +54,15 @@
 -define(UTP_PEERNAME, 8).
 -define(UTP_SETOPTS, 9).
 -define(UTP_GETOPTS, 10).
--define(UTP_CANCEL_SEND, 11).
--define(UTP_RECV, 12).
--define(UTP_CANCEL_RECV, 13).
+-define(UTP_RECV, 11).
+-define(UTP_CANCEL_RECV, 12).
+-define(UTP_SHARDS, 13).
+-define(UTP_RECV_ACK, 14).
+
+%% first byte of the data of a send, telling the driver whether the sender
+%% waits for a reply; must match SendModes in c_src/handler.h
+-define(UTP_SEND_SYNC, 0).
+-define(UTP_SEND_ASYNC, 1).
 
 -type utpstate() :: #state{}.
 -type from() :: {pid(), any()}.
@@ -100,11 +106,19 @@ listen(Port, Options) when Port >= 0, Port < 65536 ->
             {error, einval}
     end.
 
--spec accept(utpsock()) -> {ok, utpsock()} | {error, any()}.
+%% A listen socket opened with the {shards, N} option is the first of N
+%% listen sockets sharing its address, which shards/1 returns. Passing that
+%% list to accept or async_accept picks a shard by the calling process's
+%% scheduler, so acceptors running on different schedulers spread across
+%% the shards.
+-spec accept(utpsock() | [utpsock()]) -> {ok, utpsock()} | {error, any()}.
 accept(Sock) ->
     accept(Sock, infinity).
 
--spec accept(utpsock(), timeout()) -> {ok, utpsock()} | {error, any()}.
+-spec accept(utpsock() | [utpsock()], timeout()) -> {ok, utpsock()} |
+                                                    {error, any()}.
+accept(Shards, Timeout) when is_list(Shards) ->
+    accept(pick_shard(Shards), Timeout);
 accept(Sock, Timeout) ->
     Ref = make_ref(),
     Args = term_to_binary(term_to_binary(Ref)),
@@ -135,7 +149,10 @@ accept(Sock, Timeout) ->
             Error
     end.
 
--spec async_accept(utpsock()) -> {ok, reference()} | {error, any()}.
+-spec async_accept(utpsock() | [utpsock()]) -> {ok, reference()} |
+                                              {error, any()}.
+async_accept(Shards) when is_list(Shards) ->
+    async_accept(pick_shard(Shards));
 async_accept(Sock) ->
     Ref = make_ref(),
     Args = term_to_binary(term_to_binary(Ref)),
@@ -154,6 +171,21 @@ async_accept(Sock, Args) ->
             {error, einval}
     end.
 
+-spec shards(utpsock()) -> {ok, [utpsock()]} | {error, any()}.
+shards(Sock) ->
+    try
+        Ref = make_ref(),
+        Args = term_to_binary(term_to_binary(Ref)),
+        erlang:port_control(Sock, ?UTP_SHARDS, Args),
+        receive
+            {Ref, Shards} ->
+                {ok, Shards}
+        end
+    catch
+        error:badarg ->
+            {error, einval}
+    end.
+
 -spec connect(utpaddr(), utpport()) -> {ok, utpsock()} | {error, any()}.
 connect(Addr, Port) when Port > 0, Port =< 65535 ->
     connect(Addr, Port, []).
@@ -219,7 +251,9 @@ close(Sock) ->
         case binary_to_term(Result) of
             wait ->
                 receive
-                    {Ref, ok} -> ok
+                    {Ref, ok} -> ok;
+                    {Ref, {shards, Shards}} ->
+                        lists:foreach(fun close/1, Shards)
                 end;
             ok ->
                 ok
@@ -229,9 +263,46 @@ close(Sock) ->
     end,
     ok.
 
+%% The driver queues the data and replies right away. Once its write queue
+%% reaches the high_watermark option, the driver marks the port busy, which
+%% suspends further senders inside erlang:port_command/2 until the queue
+%% drains to the low_watermark. If the send timeout expires first, every
+%% suspended send fails with {error, etimedout}, and so do further sends
+%% until the queue drains. A socket closed before replying makes the send
+%% return {error, closed}.
 -spec send(utpsock(), iodata()) -> ok | {error, any()}.
 send(Sock, Data) ->
-    send(Sock, Data, os:timestamp()).
+    try
+        MRef = erlang:monitor(port, Sock),
+        try
+            true = erlang:port_command(Sock, [?UTP_SEND_SYNC|Data]),
+            receive
+                {utp_reply, Sock, Result} ->
+                    Result;
+                {'DOWN', MRef, port, Sock, _} ->
+                    {error, closed}
+            end
+        after
+            erlang:demonitor(MRef, [flush])
+        end
+    catch
+        error:badarg ->
+            {error, einval}
+    end.
+
+%% send_async/2 queues data like send/2 but does not wait for the driver,
+%% which replies only if the send fails. The failure arrives later as a
+%% {utp_error, Sock, Reason} message to the sending process. Flow control
+%% still applies, so send_async/2 blocks while the port is busy.
+-spec send_async(utpsock(), iodata()) -> ok | {error, any()}.
+send_async(Sock, Data) ->
+    try
+        true = erlang:port_command(Sock, [?UTP_SEND_ASYNC|Data]),
+        ok
+    catch
+        error:badarg ->
+            {error, einval}
+    end.
 
 -spec recv(utpsock(), non_neg_integer()) -> {ok, utpdata()} |
                                             {error, any()}.
@@ -271,6 +342,20 @@ recv(Sock, Length, Timeout) ->
             {error, closed}
     end.
 
+%% With the {recv_watermark, {Low, High}} option, data delivered to the
+%% owner of an active socket keeps occupying the socket's receive buffer
+%% until the owner acknowledges it here. Delivery stops once High bytes are
+%% unacknowledged and resumes when acknowledgements bring that down to Low.
+-spec recv_ack(utpsock(), non_neg_integer()) -> ok | {error, any()}.
+recv_ack(Sock, Bytes) when is_integer(Bytes), Bytes >= 0 ->
+    try
+        erlang:port_control(Sock, ?UTP_RECV_ACK, term_to_binary(Bytes)),
+        ok
+    catch
+        error:badarg ->
+            {error, closed}
+    end.
+
 -spec sockname(utpsock()) -> {ok, {utpaddr(), utpport()}} | {error, any()}.
 sockname(Sock) ->
     try
@@ -396,7 +481,11 @@ init([]) ->
                  end,
     case LoadResult of
         ok ->
-            Port = erlang:open_port({spawn, Shlib}, [binary]),
+            Command = case application:get_env(gen_utp, hires_timer) of
+                          {ok, true} -> Shlib ++ " hires_timer";
+                          _ -> Shlib
+                      end,
+            Port = erlang:open_port({spawn, Command}, [binary]),
             register(utpdrv, Port),
             {ok, #state{port=Port}};
         Error ->
@@ -431,67 +520,12 @@ code_change(_OldVsn, State, _Extra) ->
 
 %% Internal functions
 
-%%
-%% The send/3 function takes the socket and data to be sent, as well as a
-%% timestamp of when the operation was started. The send timeout is set
-%% when the socket is created and is stored in the driver. This function
-%% uses the starting timestamp to help enforce any send timeout.
-%%
-%% If the socket is writable, the driver takes the data and makes sure it
-%% gets sent. If it's not writable, the driver sends a message telling the
-%% sender to wait. If a send timeout is set on the socket, it includes that
-%% timeout in the message. The process then awaits a message from the
-%% driver telling it to retry. If a timeout occurs before the retry message
-%% arrives, an error is returned to the caller. When a retry arrives, check
-%% the start timestamp to ensure a timeout hasn't occurred, and if not try
-%% the send operation again.
-%%
--spec send(utpsock(), iodata(), erlang:timestamp()) -> ok | {error, any()}.
-send(Sock, Data, Start) ->
-    try
-        true = erlang:port_command(Sock, Data),
-        receive
-            {utp_reply, Sock, wait} ->
-                receive
-                    {utp_reply, Sock, retry} ->
-                        send(Sock, Data, Start)
-                end;
-            {utp_reply, Sock, {wait, Timeout}} ->
-                Current = os:timestamp(),
-                TDiff = timer:now_diff(Current, Start) div 1000,
-                case TDiff >= Timeout of
-                    true ->
-                        {error, etimedout};
-                    false ->
-                        {StartMega, StartSec, StartMicro} = Start,
-                        Done = {StartMega, StartSec, Timeout*1000+StartMicro},
-                        Wait = timer:now_diff(Done, Current) div 1000,
-                        receive
-                            {utp_reply, Sock, retry} ->
-                                send(Sock, Data, Start)
-                        after
-                            Wait ->
-                                erlang:port_control(Sock,?UTP_CANCEL_SEND,<<>>),
-                                %% if the reply comes back while the cancel
-                                %% call completes, return it
-                                receive
-                                    {utp_reply, Sock, ok} ->
-                                        ok;
-                                    {utp_reply, Sock, _} ->
-                                        {error, etimedout}
-                                after
-                                    0 ->
-                                        {error, etimedout}
-                                end
-                        end
-                end;
-            {utp_reply, Sock, Result} ->
-                Result
-        end
-    catch
-        error:badarg ->
-            {error, einval}
-    end.
+-spec pick_shard([utpsock()]) -> utpsock().
+pick_shard([Sock]) ->
+    Sock;
+pick_shard(Shards) ->
+    N = erlang:system_info(scheduler_id) rem length(Shards),
+    lists:nth(N+1, Shards).
 
 -spec validate_connect(utpsock()) -> {ok, utpsock()} | {error, any()}.
 validate_connect(Sock) ->
@@ -561,11 +595,15 @@ options_to_binary(UtpOpts) ->
                         once ->
                             <<?UTP_ACTIVE_OPT:8, ?UTP_ACTIVE_ONCE:8>>;
                         true ->
-                            <<?UTP_ACTIVE_OPT:8, ?UTP_ACTIVE_TRUE:8>>
+                            <<?UTP_ACTIVE_OPT:8, ?UTP_ACTIVE_TRUE:8>>;
+                        N ->
+                            <<?UTP_ACTIVE_OPT:8, ?UTP_ACTIVE_N:8, N:16/big-signed>>
                     end,
                     case UtpOpts#utp_options.packet of
                         undefined ->
                             <<>>;
+                        line ->
+                            <<?UTP_PACKET_OPT:8, ?UTP_PACKET_LINE:8>>;
                         Val ->
                             <<?UTP_PACKET_OPT:8, Val:8>>
                     end,
@@ -586,5 +624,91 @@ options_to_binary(UtpOpts) ->
                             <<>>;
                         RecBuf ->
                             <<?UTP_RECBUF_OPT:8, RecBuf:32/big>>
+                    end,
+                    case UtpOpts#utp_options.recv_batch of
+                        undefined ->
+                            <<>>;
+                        RecvBatch ->
+                            <<?UTP_RECV_BATCH_OPT:8, RecvBatch:16/big>>
+                    end,
+                    case UtpOpts#utp_options.gso of
+                        undefined ->
+                            <<>>;
+                        false ->
+                            <<?UTP_GSO_OPT:8, 0:8>>;
+                        true ->
+                            <<?UTP_GSO_OPT:8, 1:8>>
+                    end,
+                    case UtpOpts#utp_options.gro of
+                        undefined ->
+                            <<>>;
+                        false ->
+                            <<?UTP_GRO_OPT:8, 0:8>>;
+                        true ->
+                            <<?UTP_GRO_OPT:8, 1:8>>
+                    end,
+                    case UtpOpts#utp_options.shared_socket of
+                        undefined ->
+                            <<>>;
+                        false ->
+                            <<?UTP_SHARED_SOCKET_OPT:8, 0:8>>;
+                        true ->
+                            <<?UTP_SHARED_SOCKET_OPT:8, 1:8>>
+                    end,
+                    case UtpOpts#utp_options.backlog of
+                        undefined ->
+                            <<>>;
+                        Backlog ->
+                            <<?UTP_BACKLOG_OPT:8, Backlog:16/big>>
+                    end,
+                    case UtpOpts#utp_options.shards of
+                        undefined ->
+                            <<>>;
+                        Shards ->
+                            <<?UTP_SHARDS_OPT:8, Shards:8>>
+                    end,
+                    case UtpOpts#utp_options.active_batch of
+                        undefined ->
+                            <<>>;
+                        Batch ->
+                            <<?UTP_ACTIVE_BATCH_OPT:8, Batch:32/big>>
+                    end,
+                    case UtpOpts#utp_options.recv_watermark of
+                        undefined ->
+                            <<>>;
+                        {Low, High} ->
+                            <<?UTP_RECV_WATERMARK_OPT:8, Low:32/big, High:32/big>>
+                    end,
+                    case UtpOpts#utp_options.high_watermark of
+                        undefined ->
+                            <<>>;
+                        HighWM ->
+                            <<?UTP_HIGH_WATERMARK_OPT:8, HighWM:32/big>>
+                    end,
+                    case UtpOpts#utp_options.low_watermark of
+                        undefined ->
+                            <<>>;
+                        LowWM ->
+                            <<?UTP_LOW_WATERMARK_OPT:8, LowWM:32/big>>
+                    end,
+                    case UtpOpts#utp_options.zerocopy of
+                        undefined ->
+                            <<>>;
+                        false ->
+                            <<?UTP_ZEROCOPY_OPT:8, 0:8>>;
+                        true ->
+                            <<?UTP_ZEROCOPY_OPT:8, 1:8>>
+                    end,
+                    case UtpOpts#utp_options.packet_size of
+                        undefined ->
+                            <<>>;
+                        PktMax ->
+                            <<?UTP_PACKET_SIZE_OPT:8, PktMax:32/big>>
+                    end,
+                    case UtpOpts#utp_options.line_delimiter of
+                        undefined ->
+                            <<>>;
+                        Delim ->
+                            <<?UTP_LINE_DELIMITER_OPT:8, Delim:8>>
                     end
                    ]).
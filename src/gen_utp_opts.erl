@@ -37,25 +37,59 @@
 -type utpportopt() :: {port,gen_utp:utpport()}.
 -type utpmodeopt() :: {mode,utpmode()} | utpmode().
 -type utpsendopt() :: {send_timeout,utptimeout()}.
--type utpactive() :: once | boolean().
+-type utpactive() :: once | boolean() | -32768..32767.
 -type utpactiveopt() :: {active, utpactive()}.
--type utppacketsize() :: raw | 0 | 1 | 2 | 4.
+-type utppacketsize() :: raw | 0 | 1 | 2 | 4 | line.
 -type utppacketopt() :: {packet, utppacketsize()}.
 -type utpheadersize() :: pos_integer().
 -type utpheaderopt() :: {header, utpheadersize()}.
 -type utpbufsize() :: pos_integer().
 -type utpbuftype() :: sndbuf | recbuf.
 -type utpsetbuf() :: {utpbuftype(), utpbufsize()}.
+-type utprecvbatch() :: 1..?UTP_RECV_BATCH_MAX.
+-type utprecvbatchopt() :: {recv_batch, utprecvbatch()}.
+-type utpgsoopt() :: {gso, boolean()}.
+-type utpgroopt() :: {gro, boolean()}.
+-type utpsharedopt() :: {shared_socket, boolean()}.
+-type utpbacklog() :: 0..65535.
+-type utpbacklogopt() :: {backlog, utpbacklog()}.
+-type utpshards() :: 1..64.
+-type utpshardsopt() :: {shards, utpshards()}.
+-type utpactivebatch() :: 0..16#ffffffff.
+-type utpactivebatchopt() :: {active_batch, utpactivebatch()}.
+-type utprecvwatermark() :: {non_neg_integer(), non_neg_integer()}.
+-type utprecvwatermarkopt() :: {recv_watermark, utprecvwatermark()}.
+-type utpwatermark() :: non_neg_integer().
+-type utphighwatermarkopt() :: {high_watermark, utpwatermark()}.
+-type utplowwatermarkopt() :: {low_watermark, utpwatermark()}.
+-type utpzerocopyopt() :: {zerocopy, boolean()}.
+-type utppacketmax() :: 0..16#ffffffff.
+-type utppacketmaxopt() :: {packet_size, utppacketmax()}.
+-type utplinedelimiteropt() :: {line_delimiter, byte()}.
 -type utpopt() :: utpipopt() | utpportopt() | utpmodeopt() |
                   utpfamily() | utpsendopt() | utpactiveopt() |
-                  utppacketopt() | utpheaderopt() | utpsetbuf().
+                  utppacketopt() | utpheaderopt() | utpsetbuf() |
+                  utprecvbatchopt() | utpgsoopt() | utpgroopt() |
+                  utpsharedopt() | utpbacklogopt() | utpshardsopt() |
+                  utpactivebatchopt() | utprecvwatermarkopt() |
+                  utphighwatermarkopt() | utplowwatermarkopt() |
+                  utpzerocopyopt() | utppacketmaxopt() |
+                  utplinedelimiteropt().
 -type utpopts() :: [utpopt()].
 -type utpgetoptname() :: active | mode | send_timeout |
-                         packet | header | utpbuftype().
+                         packet | header | utpbuftype() | recv_batch |
+                         gso | gro | gro_segments | shared_socket |
+                         backlog | backlog_stats | shards | active_batch |
+                         recv_watermark | high_watermark | low_watermark |
+                         zerocopy | packet_size | line_delimiter.
 -type utpgetoptnames() :: [utpgetoptname()].
--export_type([utpactive/0, utpbufsize/0, utpfamily/0, utpgetoptnames/0,
-              utpheadersize/0, utpmode/0, utpopts/0, utppacketsize/0,
-              utptimeout/0]).
+-export_type([utpactive/0, utpactivebatch/0, utpbacklog/0, utpbufsize/0,
+              utpfamily/0,
+              utpgetoptnames/0,
+              utpheadersize/0, utpmode/0, utpopts/0, utppacketmax/0,
+              utppacketsize/0,
+              utprecvbatch/0, utprecvwatermark/0, utpshards/0,
+              utptimeout/0, utpwatermark/0]).
 
 -spec validate(utpopts()) -> #utp_options{}.
 validate(Opts) when is_list(Opts) ->
@@ -79,6 +113,36 @@ validate_names(OptNames) when is_list(OptNames) ->
                                  <<Bin/binary, ?UTP_SNDBUF_OPT:8>>;
                             (recbuf, Bin) ->
                                  <<Bin/binary, ?UTP_RECBUF_OPT:8>>;
+                            (recv_batch, Bin) ->
+                                 <<Bin/binary, ?UTP_RECV_BATCH_OPT:8>>;
+                            (gso, Bin) ->
+                                 <<Bin/binary, ?UTP_GSO_OPT:8>>;
+                            (gro, Bin) ->
+                                 <<Bin/binary, ?UTP_GRO_OPT:8>>;
+                            (gro_segments, Bin) ->
+                                 <<Bin/binary, ?UTP_GRO_SEGMENTS_OPT:8>>;
+                            (shared_socket, Bin) ->
+                                 <<Bin/binary, ?UTP_SHARED_SOCKET_OPT:8>>;
+                            (backlog, Bin) ->
+                                 <<Bin/binary, ?UTP_BACKLOG_OPT:8>>;
+                            (backlog_stats, Bin) ->
+                                 <<Bin/binary, ?UTP_BACKLOG_STATS_OPT:8>>;
+                            (shards, Bin) ->
+                                 <<Bin/binary, ?UTP_SHARDS_OPT:8>>;
+                            (active_batch, Bin) ->
+                                 <<Bin/binary, ?UTP_ACTIVE_BATCH_OPT:8>>;
+                            (recv_watermark, Bin) ->
+                                 <<Bin/binary, ?UTP_RECV_WATERMARK_OPT:8>>;
+                            (high_watermark, Bin) ->
+                                 <<Bin/binary, ?UTP_HIGH_WATERMARK_OPT:8>>;
+                            (low_watermark, Bin) ->
+                                 <<Bin/binary, ?UTP_LOW_WATERMARK_OPT:8>>;
+                            (zerocopy, Bin) ->
+                                 <<Bin/binary, ?UTP_ZEROCOPY_OPT:8>>;
+                            (packet_size, Bin) ->
+                                 <<Bin/binary, ?UTP_PACKET_SIZE_OPT:8>>;
+                            (line_delimiter, Bin) ->
+                                 <<Bin/binary, ?UTP_LINE_DELIMITER_OPT:8>>;
                             (_, _) ->
                                  {error, einval}
                          end, <<>>, OptNames),
@@ -145,12 +209,15 @@ validate([{send_timeout,_}=ST|_], _) ->
 validate([{active,Active}|Opts], UtpOpts)
   when is_boolean(Active); Active =:= once ->
     validate(Opts, UtpOpts#utp_options{active=Active});
+validate([{active,N}|Opts], UtpOpts)
+  when is_integer(N), N >= -32768, N =< 32767 ->
+    validate(Opts, UtpOpts#utp_options{active=N});
 validate([{active,_}=Active|_], _) ->
     erlang:error(badarg, [Active]);
 validate([{packet,raw}|Opts], UtpOpts) ->
     validate([{packet,0}|Opts], UtpOpts);
 validate([{packet,P}|Opts], UtpOpts)
-  when P == 0; P == 1; P == 2; P == 4 ->
+  when P == 0; P == 1; P == 2; P == 4; P == line ->
     validate(Opts, UtpOpts#utp_options{packet=P});
 validate([{packet,_}=Packet|_], _) ->
     erlang:error(badarg, [Packet]);
@@ -167,7 +234,69 @@ validate([{recbuf,Sz}|Opts], UtpOpts) when is_integer(Sz), Sz > 0 ->
     validate(Opts, UtpOpts#utp_options{recbuf=Sz});
 validate([{recbuf,_}=Hdr|_], _) ->
     erlang:error(badarg, [Hdr]);
+validate([{recv_batch,N}|Opts], UtpOpts)
+  when is_integer(N), N > 0, N =< ?UTP_RECV_BATCH_MAX ->
+    validate(Opts, UtpOpts#utp_options{recv_batch=N});
+validate([{recv_batch,_}=RB|_], _) ->
+    erlang:error(badarg, [RB]);
+validate([{gso,Gso}|Opts], UtpOpts) when is_boolean(Gso) ->
+    validate(Opts, UtpOpts#utp_options{gso=Gso});
+validate([{gso,_}=Gso|_], _) ->
+    erlang:error(badarg, [Gso]);
+validate([{gro,Gro}|Opts], UtpOpts) when is_boolean(Gro) ->
+    validate(Opts, UtpOpts#utp_options{gro=Gro});
+validate([{gro,_}=Gro|_], _) ->
+    erlang:error(badarg, [Gro]);
+validate([{shared_socket,Shared}|Opts], UtpOpts) when is_boolean(Shared) ->
+    validate(Opts, UtpOpts#utp_options{shared_socket=Shared});
+validate([{shared_socket,_}=Shared|_], _) ->
+    erlang:error(badarg, [Shared]);
+validate([{backlog,N}|Opts], UtpOpts)
+  when is_integer(N), N >= 0, N < 65536 ->
+    validate(Opts, UtpOpts#utp_options{backlog=N});
+validate([{backlog,_}=Backlog|_], _) ->
+    erlang:error(badarg, [Backlog]);
+validate([{shards,N}|Opts], UtpOpts) when is_integer(N), N > 0, N =< 64 ->
+    validate(Opts, UtpOpts#utp_options{shards=N});
+validate([{shards,_}=Shards|_], _) ->
+    erlang:error(badarg, [Shards]);
+validate([{active_batch,B}|Opts], UtpOpts)
+  when is_integer(B), B >= 0, B =< 16#ffffffff ->
+    validate(Opts, UtpOpts#utp_options{active_batch=B});
+validate([{active_batch,_}=Batch|_], _) ->
+    erlang:error(badarg, [Batch]);
+validate([{recv_watermark,{Low,High}=WM}|Opts], UtpOpts)
+  when is_integer(Low), is_integer(High), Low >= 0, Low =< High,
+       High =< 16#ffffffff ->
+    validate(Opts, UtpOpts#utp_options{recv_watermark=WM});
+validate([{recv_watermark,_}=WM|_], _) ->
+    erlang:error(badarg, [WM]);
+validate([{high_watermark,WM}|Opts], UtpOpts)
+  when is_integer(WM), WM >= 0, WM =< 16#ffffffff ->
+    validate(Opts, UtpOpts#utp_options{high_watermark=WM});
+validate([{high_watermark,_}=WM|_], _) ->
+    erlang:error(badarg, [WM]);
+validate([{low_watermark,WM}|Opts], UtpOpts)
+  when is_integer(WM), WM >= 0, WM =< 16#ffffffff ->
+    validate(Opts, UtpOpts#utp_options{low_watermark=WM});
+validate([{low_watermark,_}=WM|_], _) ->
+    erlang:error(badarg, [WM]);
+validate([{zerocopy,ZC}|Opts], UtpOpts) when is_boolean(ZC) ->
+    validate(Opts, UtpOpts#utp_options{zerocopy=ZC});
+validate([{zerocopy,_}=ZC|_], _) ->
+    erlang:error(badarg, [ZC]);
+validate([{packet_size,Sz}|Opts], UtpOpts)
+  when is_integer(Sz), Sz >= 0, Sz =< 16#ffffffff ->
+    validate(Opts, UtpOpts#utp_options{packet_size=Sz});
+validate([{packet_size,_}=Sz|_], _) ->
+    erlang:error(badarg, [Sz]);
+validate([{line_delimiter,C}|Opts], UtpOpts)
+  when is_integer(C), C >= 0, C =< 255 ->
+    validate(Opts, UtpOpts#utp_options{line_delimiter=C});
+validate([{line_delimiter,_}=Delim|_], _) ->
+    erlang:error(badarg, [Delim]);
 validate([], UtpOpts) ->
+    validate_watermarks(UtpOpts),
     case UtpOpts#utp_options.header of
         undefined ->
             UtpOpts;
@@ -181,6 +310,15 @@ validate([], UtpOpts) ->
             end
     end.
 
+%% When both watermarks are given the low one must not exceed the high
+%% one. A lone watermark is checked by the driver instead, which moves the
+%% socket's other watermark to match it, as gen_tcp does.
+validate_watermarks(#utp_options{high_watermark=High, low_watermark=Low})
+  when is_integer(High), is_integer(Low), Low > High ->
+    erlang:error(badarg, [{low_watermark,Low},{high_watermark,High}]);
+validate_watermarks(_) ->
+    ok.
+
 validate_ipaddr(IpAddr, UtpOpts) when is_tuple(IpAddr) ->
     try inet_parse:ntoa(IpAddr) of
         ListAddr ->
@@ -222,9 +360,41 @@ validate_test() ->
     ?assertMatch(#utp_options{packet=1}, validate([{packet,1}])),
     ?assertMatch(#utp_options{packet=2}, validate([{packet,2}])),
     ?assertMatch(#utp_options{packet=4}, validate([{packet,4}])),
+    ?assertMatch(#utp_options{packet=line}, validate([{packet,line}])),
     ?assertMatch(#utp_options{header=1}, validate([binary,{header,1}])),
     ?assertMatch(#utp_options{sndbuf=16384}, validate([{sndbuf,16384}])),
     ?assertMatch(#utp_options{recbuf=32768}, validate([{recbuf,32768}])),
+    ?assertMatch(#utp_options{recv_batch=1}, validate([{recv_batch,1}])),
+    ?assertMatch(#utp_options{recv_batch=64}, validate([{recv_batch,64}])),
+    ?assertMatch(#utp_options{gso=true}, validate([{gso,true}])),
+    ?assertMatch(#utp_options{gso=false}, validate([{gso,false}])),
+    ?assertMatch(#utp_options{gro=true}, validate([{gro,true}])),
+    ?assertMatch(#utp_options{shared_socket=true},
+                 validate([{shared_socket,true}])),
+    ?assertMatch(#utp_options{backlog=0}, validate([{backlog,0}])),
+    ?assertMatch(#utp_options{backlog=128}, validate([{backlog,128}])),
+    ?assertMatch(#utp_options{shards=4}, validate([{shards,4}])),
+    ?assertMatch(#utp_options{active=10}, validate([{active,10}])),
+    ?assertMatch(#utp_options{active=-5}, validate([{active,-5}])),
+    ?assertMatch(#utp_options{active_batch=65536},
+                 validate([{active_batch,65536}])),
+    ?assertMatch(#utp_options{recv_watermark={1024,8192}},
+                 validate([{recv_watermark,{1024,8192}}])),
+    ?assertMatch(#utp_options{high_watermark=16384,low_watermark=4096},
+                 validate([{high_watermark,16384},{low_watermark,4096}])),
+    ?assertMatch(#utp_options{high_watermark=32768},
+                 validate([{high_watermark,32768}])),
+    ?assertMatch(#utp_options{low_watermark=65536},
+                 validate([{low_watermark,65536}])),
+    ?assertMatch(#utp_options{high_watermark=16384,low_watermark=undefined},
+                 validate([{high_watermark,16384}])),
+    ?assertMatch(#utp_options{high_watermark=undefined,low_watermark=131072},
+                 validate([{low_watermark,131072}])),
+    ?assertMatch(#utp_options{zerocopy=true}, validate([{zerocopy,true}])),
+    ?assertMatch(#utp_options{packet_size=65536},
+                 validate([{packet_size,65536}])),
+    ?assertMatch(#utp_options{line_delimiter=$;},
+                 validate([{line_delimiter,$;}])),
 
     ?assertException(error, badarg, validate([{mode,bin}])),
     ?assertException(error, badarg, validate([{port,65536}])),
@@ -232,16 +402,43 @@ validate_test() ->
     ?assertException(error, badarg, validate([{ip,"::"},inet])),
     ?assertException(error, badarg, validate([{send_timeout,0}])),
     ?assertException(error, badarg, validate([{active,never}])),
+    ?assertException(error, badarg, validate([{active,32768}])),
     ?assertException(error, badarg, validate([{ip,{1,2,3,4,5}}])),
     ?assertException(error, badarg, validate([{ip,"1.2.3.4.5"}])),
     ?assertException(error, badarg, validate([{packet,3}])),
     ?assertException(error, badarg, validate([{header,1}])),
     ?assertException(error, badarg, validate([{sndbuf,0}])),
     ?assertException(error, badarg, validate([{recbuf,0}])),
+    ?assertException(error, badarg, validate([{recv_batch,0}])),
+    ?assertException(error, badarg, validate([{recv_batch,65}])),
+    ?assertException(error, badarg, validate([{gso,1}])),
+    ?assertException(error, badarg, validate([{gro,yes}])),
+    ?assertException(error, badarg, validate([{shared_socket,on}])),
+    ?assertException(error, badarg, validate([{backlog,-1}])),
+    ?assertException(error, badarg, validate([{backlog,65536}])),
+    ?assertException(error, badarg, validate([{shards,0}])),
+    ?assertException(error, badarg, validate([{shards,65}])),
+    ?assertException(error, badarg, validate([{active_batch,-1}])),
+    ?assertException(error, badarg, validate([{recv_watermark,{2,1}}])),
+    ?assertException(error, badarg, validate([{recv_watermark,1024}])),
+    ?assertException(error, badarg, validate([{high_watermark,-1}])),
+    ?assertException(error, badarg, validate([{low_watermark,infinity}])),
+    ?assertException(error, badarg,
+                     validate([{high_watermark,4096},{low_watermark,8192}])),
+    ?assertException(error, badarg, validate([{zerocopy,1}])),
+    ?assertException(error, badarg, validate([{packet,http}])),
+    ?assertException(error, badarg, validate([{packet_size,-1}])),
+    ?assertException(error, badarg, validate([{packet_size,1 bsl 32}])),
+    ?assertException(error, badarg, validate([{line_delimiter,256}])),
+    ?assertException(error, badarg, validate([{line_delimiter,"\r\n"}])),
     ok.
 
 validate_names_test() ->
-    OkOpts = [active,mode,send_timeout,packet,header,sndbuf,recbuf],
+    OkOpts = [active,mode,send_timeout,packet,header,sndbuf,recbuf,
+              recv_batch,gso,gro,gro_segments,shared_socket,backlog,
+              backlog_stats,shards,active_batch,recv_watermark,
+              high_watermark,low_watermark,zerocopy,
+              packet_size,line_delimiter],
     ?assertMatch({ok,_}, validate_names(OkOpts)),
     ?assertMatch({error, einval}, validate_names([list])),
     ?assertMatch({error, einval}, validate_names([binary])),
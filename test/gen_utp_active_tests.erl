@@ -36,7 +36,15 @@ active_test_() ->
                {"active once test",
                 fun active_once/0},
                {"active true test",
-                fun active_true/0}
+                fun active_true/0},
+               {"active N test",
+                fun active_n/0},
+               {"active batch test",
+                fun() -> active_batch(0) end},
+               {"active batch packet test",
+                fun() -> active_batch(1) end},
+               {"active recv_watermark test",
+                fun recv_watermark/0}
               ]}
      end}.
 
@@ -138,3 +146,145 @@ active_true() ->
     end,
     ok = gen_utp:close(LSock),
     ok.
+
+active_n() ->
+    {ok, LSock} = gen_utp:listen(0, [{mode,list},{active,false},{packet,1}]),
+    {ok, Ref} = gen_utp:async_accept(LSock),
+    {ok, {_, Port}} = gen_utp:sockname(LSock),
+    {ok, Sock} = gen_utp:connect("localhost", Port, [binary,{packet,1}]),
+    receive
+        {utp_async, LSock, Ref, {ok, ASock}} ->
+            Words = ["We", "make", "Riak,", "the", "most", "powerful",
+                     "open-source,", "distributed", "database", "you'll",
+                     "ever", "put", "into", "production."],
+            ?assertEqual([ok || _ <- Words],
+                         [gen_utp:send(Sock, Data) || Data <- Words]),
+            timer:sleep(500),
+            F = fun(Fn, Acc) ->
+                        receive
+                            {utp, ASock, Word} ->
+                                Fn(Fn, [Word|Acc]);
+                            {utp_passive, ASock} ->
+                                {passive, lists:reverse(Acc)}
+                        after
+                            500 ->
+                                {active, lists:reverse(Acc)}
+                        end
+                end,
+            {First, Rest} = lists:split(3, Words),
+            ok = gen_utp:setopts(ASock, [{active,3}]),
+            ?assertMatch({passive, First}, F(F,[])),
+            ?assertMatch({ok, [{active,false}]},
+                         gen_utp:getopts(ASock, [active])),
+            ok = gen_utp:setopts(ASock, [{active,100}]),
+            ?assertMatch({active, Rest}, F(F,[])),
+            N = 100 - length(Rest),
+            ?assertMatch({ok, [{active,N}]}, gen_utp:getopts(ASock, [active])),
+            %% a further {active,N} adds to the count
+            ok = gen_utp:setopts(ASock, [{active,-N}]),
+            ?assertMatch({passive, []}, F(F,[])),
+            ok = gen_utp:close(ASock),
+            ok = gen_utp:close(Sock);
+        {utp_async, LSock, Ref, Error} ->
+            exit({utp_async, Error})
+    after
+        3000 -> exit(failure)
+    end,
+    ok = gen_utp:close(LSock),
+    ok.
+
+active_batch(Packet) ->
+    {ok, LSock} = gen_utp:listen(0, [{mode,list},{active,false},
+                                     {packet,Packet}]),
+    {ok, Ref} = gen_utp:async_accept(LSock),
+    {ok, {_, Port}} = gen_utp:sockname(LSock),
+    {ok, Sock} = gen_utp:connect("localhost", Port, [binary,{packet,Packet}]),
+    receive
+        {utp_async, LSock, Ref, {ok, ASock}} ->
+            Words = ["We", "make", "Riak,", "the", "most", "powerful",
+                     "open-source,", "distributed", "database", "you'll",
+                     "ever", "put", "into", "production."],
+            ?assertEqual([ok || _ <- Words],
+                         [gen_utp:send(Sock, Data) || Data <- Words]),
+            timer:sleep(500),
+            %% everything queued arrives in a single message
+            ok = gen_utp:setopts(ASock, [{active_batch,65536},{active,once}]),
+            ?assertMatch({ok, [{active_batch,65536}]},
+                         gen_utp:getopts(ASock, [active_batch])),
+            case Packet of
+                0 ->
+                    AllWords = lists:append(Words),
+                    receive
+                        {utp, ASock, Data} ->
+                            ?assertMatch(AllWords, Data)
+                    after
+                        2000 -> exit(failure)
+                    end;
+                _ ->
+                    receive
+                        {utp_batch, ASock, Msgs} ->
+                            ?assertMatch(Words, Msgs)
+                    after
+                        2000 -> exit(failure)
+                    end
+            end,
+            ok = gen_utp:close(ASock),
+            ok = gen_utp:close(Sock);
+        {utp_async, LSock, Ref, Error} ->
+            exit({utp_async, Error})
+    after
+        3000 -> exit(failure)
+    end,
+    ok = gen_utp:close(LSock),
+    ok.
+
+recv_watermark() ->
+    {ok, LSock} = gen_utp:listen(0, [{mode,list},{active,false},{packet,1}]),
+    {ok, Ref} = gen_utp:async_accept(LSock),
+    {ok, {_, Port}} = gen_utp:sockname(LSock),
+    {ok, Sock} = gen_utp:connect("localhost", Port, [binary,{packet,1}]),
+    receive
+        {utp_async, LSock, Ref, {ok, ASock}} ->
+            Words = ["We", "make", "Riak,", "the", "most", "powerful",
+                     "open-source,", "distributed", "database", "you'll",
+                     "ever", "put", "into", "production."],
+            ?assertEqual([ok || _ <- Words],
+                         [gen_utp:send(Sock, Data) || Data <- Words]),
+            timer:sleep(500),
+            ok = gen_utp:setopts(ASock, [{recv_watermark,{0,10}},{active,true}]),
+            ?assertMatch({ok, [{recv_watermark,{0,10}}]},
+                         gen_utp:getopts(ASock, [recv_watermark])),
+            %% delivery stops once 10 or more bytes are unacknowledged
+            ?assertMatch(["We", "make", "Riak,"], drain_words(ASock, [])),
+            ok = gen_utp:recv_ack(ASock, 11),
+            ?assertMatch(["the", "most", "powerful"], drain_words(ASock, [])),
+            Rest = acked_words(ASock, 15, []),
+            ?assertMatch(Words, ["We", "make", "Riak,", "the", "most",
+                                 "powerful" | Rest]),
+            ok = gen_utp:close(ASock),
+            ok = gen_utp:close(Sock);
+        {utp_async, LSock, Ref, Error} ->
+            exit({utp_async, Error})
+    after
+        3000 -> exit(failure)
+    end,
+    ok = gen_utp:close(LSock),
+    ok.
+
+drain_words(Sock, Acc) ->
+    receive
+        {utp, Sock, Word} ->
+            drain_words(Sock, [Word|Acc])
+    after
+        500 ->
+            lists:reverse(Acc)
+    end.
+
+acked_words(Sock, Ack, Acc) ->
+    ok = gen_utp:recv_ack(Sock, Ack),
+    case drain_words(Sock, []) of
+        [] ->
+            lists:append(lists:reverse(Acc));
+        Words ->
+            acked_words(Sock, length(lists:append(Words)), [Words|Acc])
+    end.
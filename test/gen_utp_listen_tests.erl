@@ -44,7 +44,13 @@ listen_test_() ->
                {"accept timeout test",
                 fun accept_timeout/0},
                {"concurrent accepts",
-                fun concurrent_accepts/0}
+                fun concurrent_accepts/0},
+               {"accept from backlog test",
+                fun accept_backlog/0},
+               {"sharded listen test",
+                fun sharded_listen/0},
+               {"shared socket listen test",
+                fun shared_socket_listen/0}
               ]}
      end}.
 
@@ -111,6 +117,84 @@ accept_timeout() ->
     ?assertMatch({error, etimedout}, gen_utp:accept(LSock, 2000)),
     ok.
 
+accept_backlog() ->
+    {ok, LSock} = gen_utp:listen(0, [binary, {active, false},
+                                        {backlog, 1}]),
+    ?assertMatch({ok, [{backlog, 1}]}, gen_utp:getopts(LSock, [backlog])),
+    {ok, {_, Port}} = gen_utp:sockname(LSock),
+    {ok, C} = gen_utp:connect("127.0.0.1", Port, [binary]),
+    ok = gen_utp:send(C, <<"early">>),
+    timer:sleep(100),
+    ?assertMatch({ok, [{backlog_stats, {1, 0}}]},
+                 gen_utp:getopts(LSock, [backlog_stats])),
+    {ok, S} = gen_utp:accept(LSock, 2000),
+    ?assertMatch({ok, <<"early">>}, gen_utp:recv(S, 5, 2000)),
+    ?assertMatch({ok, [{backlog_stats, {0, 0}}]},
+                 gen_utp:getopts(LSock, [backlog_stats])),
+    ok = gen_utp:close(C),
+    ok = gen_utp:close(S),
+    ok = gen_utp:close(LSock),
+    ok.
+
+sharded_listen() ->
+    Ports = length(erlang:ports()),
+    {ok, LSock} = gen_utp:listen(0, [binary, {shards, 4}]),
+    ?assertEqual(Ports+4, length(erlang:ports())),
+    {ok, Shards} = gen_utp:shards(LSock),
+    ?assertEqual(4, length(Shards)),
+    ?assertEqual(LSock, hd(Shards)),
+    {ok, {_, Port}} = gen_utp:sockname(LSock),
+    ?assert(lists:all(fun(S) -> {ok, Port} =:= gen_utp:port(S) end, Shards)),
+    ?assertMatch({ok, [{shards, 4}]}, gen_utp:getopts(LSock, [shards])),
+    Clients = [begin
+                   {ok, C} = gen_utp:connect("127.0.0.1", Port, [binary]),
+                   C
+               end || _ <- lists:seq(1, 4)],
+    Accepted = [begin
+                    {ok, S} = gen_utp:accept(Shards, 2000),
+                    S
+                end || _ <- Clients],
+    [ok = gen_utp:close(S) || S <- Accepted ++ Clients],
+    ?assertMatch(ok, gen_utp:close(LSock)),
+    ?assert(lists:all(fun(S) -> undefined =:= erlang:port_info(S) end,
+                      Shards)),
+    ?assertEqual(Ports, length(erlang:ports())),
+    ok.
+
+shared_socket_listen() ->
+    {ok, LSock} = gen_utp:listen(0, [binary, {active, false},
+                                        {shared_socket, true}]),
+    ?assertMatch({ok, [{shared_socket, true}]},
+                 gen_utp:getopts(LSock, [shared_socket])),
+    {ok, {_, Port}} = gen_utp:sockname(LSock),
+    Pairs = [begin
+                 {ok, C} = gen_utp:connect("127.0.0.1", Port, [binary]),
+                 {ok, S} = gen_utp:accept(LSock, 2000),
+                 {C, S}
+             end || _ <- lists:seq(1, 3)],
+    Echo = fun({C, S}) ->
+                   Bin = term_to_binary({C, S}),
+                   Size = byte_size(Bin),
+                   ok = gen_utp:send(C, Bin),
+                   ?assertMatch({ok, Bin}, gen_utp:recv(S, Size, 2000)),
+                   ok = gen_utp:send(S, Bin),
+                   receive
+                       {utp, C, Data} -> ?assertEqual(Bin, Data)
+                   after
+                       2000 -> exit(failure)
+                   end
+           end,
+    lists:foreach(Echo, Pairs),
+    %% accepted connections keep the shared socket open after the
+    %% listen port closes
+    ?assertMatch(ok, gen_utp:close(LSock)),
+    lists:foreach(Echo, Pairs),
+    [begin
+         ok = gen_utp:close(C),
+         ok = gen_utp:close(S)
+     end || {C, S} <- Pairs],
+    ok.
+
 concurrent_accepts() ->
     Self = self(),
     Count = 1000,